@@ -0,0 +1,199 @@
+#include "stdio.h" //printf, popen
+#include "stdlib.h" //exit, atoi, strtod
+#include "string.h" //strstr, strlen
+#include "unistd.h" //fork, execv, pipe, dup2
+#include "fcntl.h" //open
+#include "getopt.h" //getopt
+#include "time.h" //clock_gettime
+#include "sys/wait.h" //wait4
+#include "sys/resource.h" //struct rusage
+
+//Benchmark driver, make bench runs it.
+//Generates inputs over a sweep of sizes with bench/gen, links each a few times with
+//linker --stats and prints one row per input: throughput of each pass and peak RSS.
+//Pass 1 throughput is tokens/s, pass 2 is instructions relocated/s, best run of each input.
+//The last case links millions of instructions in the linker's large mode.
+
+typedef struct{
+     const char* name; //Row label
+     int modules; //gen -m
+     int defs; //gen -d
+     int uses; //gen -u
+     const char* mix; //gen -x
+     const char* faults; //gen -f
+     long instrs; //gen -i, the classic limit of 512 outside large mode
+     int width; //gen -w and linker --operand-width, 0 links in classic mode
+}BenchCase;
+
+typedef struct{
+     long tokens, instrs, bytes; //From gen
+     double wall, pass1, pass2; //Seconds, best run
+     long peakRss; //KB, largest over the runs
+}BenchResult;
+
+void usage(const char*); //Prints the options, exit()
+void generateInput(const char*, BenchCase*, const char*, BenchResult*); //Runs gen, reads its counts
+void runLinker(const char*, const char*, int, const char*, BenchResult*); //Links once, keeps the best times
+double nowSeconds(); //Monotonic clock in seconds
+
+int main(int argc, char* argv[]){
+     static BenchCase cases[] = {
+          {"small", 1000, 4, 4, "1,1,1,1", "0", 512, 0},
+          {"medium", 10000, 4, 4, "1,1,1,1", "0", 512, 0},
+          {"large", 100000, 4, 4, "1,1,1,1", "0", 512, 0},
+          {"xlarge", 1000000, 4, 4, "1,1,1,1", "0", 512, 0},
+          {"wide", 100000, 16, 16, "1,1,1,1", "0", 512, 0},
+          {"extern", 100000, 4, 4, "0,1,0,0", "0", 512, 0},
+          {"faulty", 100000, 4, 4, "1,1,1,1", "0.05", 512, 0},
+          {"bigimage", 100000, 4, 4, "1,1,1,1", "0", 4000000, 7},
+     };
+     const char* linker = "./linker";
+     const char* gen = "./bench/gen";
+     const char* jobs = NULL; //Passed to the linker as -j
+     char input[256];
+     const char* tmp;
+     BenchResult r;
+     int reps = 3, maxModules = 1000000;
+     int c, i, opt;
+
+     while ((opt = getopt(argc, argv, "l:g:r:j:m:")) != -1){
+          switch (opt){
+          case 'l':
+               linker = optarg;
+               break;
+          case 'g':
+               gen = optarg;
+               break;
+          case 'r':
+               reps = atoi(optarg);
+               break;
+          case 'j':
+               jobs = optarg;
+               break;
+          case 'm':
+               maxModules = atoi(optarg);
+               break;
+          default:
+               usage(argv[0]);
+          }
+     }
+     if (reps < 1){
+          usage(argv[0]);
+     }
+     tmp = getenv("TMPDIR");
+     snprintf(input, sizeof(input), "%s/linker-bench-%d.txt", tmp != NULL ? tmp : "/tmp", (int)getpid());
+
+     printf("%-8s %8s %10s %9s %6s %8s %8s %8s %9s %10s %9s\n", "case", "modules", "bytes", "tokens", "instrs",
+          "wall_s", "pass1_s", "pass2_s", "Mtok/s", "instr/s", "rss_kb");
+     for (c = 0; c<(int)(sizeof(cases)/sizeof(cases[0])); c++){
+          if (cases[c].modules > maxModules){
+               continue;
+          }
+          generateInput(gen, &cases[c], input, &r);
+          r.wall = r.pass1 = r.pass2 = -1;
+          r.peakRss = 0;
+          for (i = 0; i<reps; i++){
+               runLinker(linker, jobs, cases[c].width, input, &r);
+          }
+          printf("%-8s %8d %10ld %9ld %6ld %8.3f %8.3f %8.3f %9.2f %10.0f %9ld\n", cases[c].name, cases[c].modules,
+               r.bytes, r.tokens, r.instrs, r.wall, r.pass1, r.pass2,
+               r.pass1 > 0 ? r.tokens / r.pass1 / 1e6 : 0.0, r.pass2 > 0 ? r.instrs / r.pass2 : 0.0, r.peakRss);
+          fflush(stdout);
+     }
+     unlink(input);
+     return 0;
+}
+
+void usage(const char* name){
+     fprintf(stderr, "Usage: %s [-l linker] [-g gen] [-r reps] [-j N] [-m maxmodules]\n", name);
+     exit(-1);
+}
+
+void generateInput(const char* gen, BenchCase* bc, const char* input, BenchResult* r){
+     char cmd[512];
+     FILE* p;
+     int modules;
+
+     snprintf(cmd, sizeof(cmd), "%s -m %d -d %d -u %d -i %ld -x %s -f %s -o %s", gen, bc->modules, bc->defs, bc->uses, bc->instrs, bc->mix, bc->faults, input);
+     if (bc->width > 0){
+          snprintf(cmd + strlen(cmd), sizeof(cmd) - strlen(cmd), " -w %d", bc->width);
+     }
+     p = popen(cmd, "r");
+     if (p == NULL || fscanf(p, "modules=%d tokens=%ld instrs=%ld bytes=%ld", &modules, &r->tokens, &r->instrs, &r->bytes) != 4 || pclose(p) != 0){
+          fprintf(stderr, "Cannot run: %s\n", cmd);
+          exit(-1);
+     }
+}
+
+void runLinker(const char* linker, const char* jobs, int width, const char* input, BenchResult* r){
+     struct rusage ru;
+     char report[4096];
+     char widthArg[16];
+     const char* args[8]; //linker --stats [-j N] [--operand-width N] input
+     const char* field;
+     double start, wall, pass1, pass2;
+     int fds[2], status, devnull, n0;
+     long n, len;
+     pid_t pid;
+
+     if (pipe(fds) != 0){
+          fprintf(stderr, "runLinker: Failed to create pipe.\n");
+          exit(-1);
+     }
+     start = nowSeconds();
+     pid = fork();
+     if (pid == 0){ //Output is thrown away, --stats comes back on the pipe
+          devnull = open("/dev/null", O_WRONLY);
+          dup2(devnull, 1);
+          dup2(fds[1], 2);
+          close(fds[0]);
+          n0 = 0;
+          args[n0++] = linker;
+          args[n0++] = "--stats";
+          if (jobs != NULL){
+               args[n0++] = "-j";
+               args[n0++] = jobs;
+          }
+          if (width > 0){ //Large mode, the machine is as big as the operands address
+               snprintf(widthArg, sizeof(widthArg), "%d", width);
+               args[n0++] = "--operand-width";
+               args[n0++] = widthArg;
+          }
+          args[n0++] = input;
+          args[n0] = NULL;
+          execv(linker, (char* const*)args);
+          _exit(127);
+     }
+     close(fds[1]);
+     len = 0;
+     while (len < (long)sizeof(report) - 1 && (n = read(fds[0], report + len, sizeof(report) - 1 - len)) > 0){
+          len += n;
+     }
+     report[len] = '\0';
+     close(fds[0]);
+     if (pid < 0 || wait4(pid, &status, 0, &ru) != pid){
+          fprintf(stderr, "Cannot run: %s\n", linker);
+          exit(-1);
+     }
+     wall = nowSeconds() - start;
+     pass1 = (field = strstr(report, "pass1_seconds=")) != NULL ? strtod(field + strlen("pass1_seconds="), NULL) : 0;
+     pass2 = (field = strstr(report, "pass2_seconds=")) != NULL ? strtod(field + strlen("pass2_seconds="), NULL) : 0;
+     if (r->wall < 0 || wall < r->wall){
+          r->wall = wall;
+     }
+     if (r->pass1 < 0 || pass1 < r->pass1){
+          r->pass1 = pass1;
+     }
+     if (r->pass2 < 0 || pass2 < r->pass2){
+          r->pass2 = pass2;
+     }
+     if (ru.ru_maxrss > r->peakRss){
+          r->peakRss = ru.ru_maxrss;
+     }
+}
+
+double nowSeconds(){
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,236 @@
+#include "stdio.h" //fprintf, fopen
+#include "stdlib.h" //exit, atoi, atof, strtoull
+#include "getopt.h" //getopt
+
+//Synthetic linker input generator, see usage() for the knobs.
+//Modules are written 3 lines each like the sample inputs. Defs are named m<module>d<k>,
+//uses pick defs of random modules, and instructions are spread evenly over the modules.
+//With -f some defs, uses and instructions break one of the linker rules on purpose,
+//with -e the input ends in a parse error. With -w the words have wider operands for the linker's
+//large mode, and the def and use lists may be longer than 16.
+
+typedef struct{
+     int modules; //Module count
+     int defs; //Defs per module, at most 16 without -w
+     int uses; //Uses per module, at most 16 without -w
+     long instrs; //Total instructions, the linker takes at most 512 without -w
+     int width; //Operand digits, 3 unless -w, words are opcode*10^width + operand
+     int mix[4]; //Weights of I, E, A, R instructions
+     double faults; //Chance a def, use or instruction breaks a rule
+     int parseError; //End the input with a truncated module
+     unsigned long long seed; //Random seed
+}GenOptions;
+
+typedef struct{
+     long tokens; //Tokens written
+     long instrs; //Instructions written
+     long bytes; //Bytes written
+}GenCounts;
+
+unsigned long long rngState; //xorshift64 state
+
+unsigned long long nextRandom(); //Next xorshift64 value
+int randomBelow(int); //Uniform int in [0, n), 0 when n <= 0
+int chance(double); //1 with the given probability
+void usage(const char*); //Prints the options, exit()
+void generate(FILE*, GenOptions*, GenCounts*); //Writes one input
+int pickMode(int*); //Picks I, E, A or R by weight
+
+int main(int argc, char* argv[]){
+     GenOptions o = {1000, 2, 2, 512, 3, {1, 1, 1, 1}, 0.0, 0, 1};
+     GenCounts n = {0, 0, 0};
+     const char* outName = NULL;
+     FILE* out = stdout;
+     int opt, maxList = 16;
+
+     while ((opt = getopt(argc, argv, "m:d:u:i:x:f:es:o:w:")) != -1){
+          switch (opt){
+          case 'm':
+               o.modules = atoi(optarg);
+               break;
+          case 'd':
+               o.defs = atoi(optarg);
+               break;
+          case 'u':
+               o.uses = atoi(optarg);
+               break;
+          case 'i':
+               o.instrs = atol(optarg);
+               break;
+          case 'x':
+               if (sscanf(optarg, "%d,%d,%d,%d", &o.mix[0], &o.mix[1], &o.mix[2], &o.mix[3]) != 4){
+                    usage(argv[0]);
+               }
+               break;
+          case 'f':
+               o.faults = atof(optarg);
+               break;
+          case 'e':
+               o.parseError = 1;
+               break;
+          case 's':
+               o.seed = strtoull(optarg, NULL, 10);
+               break;
+          case 'o':
+               outName = optarg;
+               break;
+          case 'w':
+               o.width = atoi(optarg);
+               maxList = 1 << 20;
+               break;
+          default:
+               usage(argv[0]);
+          }
+     }
+     if (o.modules < 1 || o.defs < 0 || o.defs > maxList || o.uses < 0 || o.uses > maxList || o.instrs < 0 || o.width < 3 || o.width > 17
+          || o.mix[0] < 0 || o.mix[1] < 0 || o.mix[2] < 0 || o.mix[3] < 0 || o.mix[0] + o.mix[1] + o.mix[2] + o.mix[3] == 0){
+          usage(argv[0]);
+     }
+     rngState = o.seed == 0 ? 1 : o.seed; //xorshift state must not be 0
+     if (outName != NULL){
+          out = fopen(outName, "w");
+          if (out == NULL){
+               fprintf(stderr, "Cannot write file: %s.\n", outName);
+               exit(-1);
+          }
+     }
+     generate(out, &o, &n);
+     if (fclose(out) != 0){
+          fprintf(stderr, "Cannot write file: %s.\n", outName == NULL ? "-" : outName);
+          exit(-1);
+     }
+     //Counts for the bench driver, on stdout when the input went to a file
+     fprintf(outName != NULL ? stdout : stderr, "modules=%d tokens=%ld instrs=%ld bytes=%ld\n", o.modules, n.tokens, n.instrs, n.bytes);
+     return 0;
+}
+
+void usage(const char* name){
+     fprintf(stderr, "Usage: %s [-m modules] [-d defs] [-u uses] [-i instrs] [-x I,E,A,R] [-f faults] [-e] [-s seed] [-o file] [-w width]\n", name);
+     fprintf(stderr, "  -m  module count (1000)\n");
+     fprintf(stderr, "  -d  defs per module, 0 to 16 (2)\n");
+     fprintf(stderr, "  -u  uses per module, 0 to 16 (2)\n");
+     fprintf(stderr, "  -i  total instructions, spread over the modules (512, the linker's limit)\n");
+     fprintf(stderr, "  -x  instruction mix as weights of I,E,A,R (1,1,1,1)\n");
+     fprintf(stderr, "  -f  chance each def, use and instruction breaks a rule (0)\n");
+     fprintf(stderr, "  -e  end the input with a parse error\n");
+     fprintf(stderr, "  -s  random seed (1)\n");
+     fprintf(stderr, "  -o  output file (stdout)\n");
+     fprintf(stderr, "  -w  operand digits for linker --large, 3 to 17, lifts the list limits (3)\n");
+     exit(-1);
+}
+
+void generate(FILE* out, GenOptions* o, GenCounts* n){
+     int m, k, len, useCount, mode, first;
+     long long op, target, scale;
+
+     for (scale = 1, k = 0; k<o->width; k++){
+          scale *= 10;
+     }
+
+     for (m = 0; m<o->modules; m++){
+          len = (int)((m + 1) * o->instrs / o->modules - m * o->instrs / o->modules); //Even spread, remainder to later modules
+
+          //Def list, a fault is a rel addr past the module end (rule 5) or a name defined before (rule 2)
+          n->bytes += fprintf(out, "%d", o->defs);
+          for (k = 0; k<o->defs; k++){
+               if (chance(o->faults) && m > 0){
+                    if (randomBelow(2)){
+                         n->bytes += fprintf(out, " m%dd%d %d", m, k, len + randomBelow(10));
+                    } else{
+                         n->bytes += fprintf(out, " m%dd%d %d", randomBelow(m), k, randomBelow(len > 0 ? len : 1));
+                    }
+               } else{
+                    n->bytes += fprintf(out, " m%dd%d %d", m, k, randomBelow(len));
+               }
+          }
+          n->bytes += fprintf(out, "\n");
+          n->tokens += 1 + 2*o->defs;
+
+          //Use list, defs of consecutive modules from a random one so names do not repeat,
+          //a fault is a name nobody defines (rule 3)
+          useCount = o->defs > 0 ? o->uses : 0;
+          first = randomBelow(o->modules);
+          n->bytes += fprintf(out, "%d", useCount);
+          for (k = 0; k<useCount; k++){
+               if (chance(o->faults)){
+                    n->bytes += fprintf(out, " x%d", (int)(nextRandom() % 1000000));
+               } else{
+                    n->bytes += fprintf(out, " m%dd%d", (first + k) % o->modules, randomBelow(o->defs));
+               }
+          }
+          n->bytes += fprintf(out, "\n");
+          n->tokens += 1 + useCount;
+
+          //Program text, faults are out of range operands and opcodes (rules 6, 8, 9, 10, 11)
+          //A operands stay below 512 and faulty ones are 600, past the classic machine, so with -w
+          //they only break rule 8 when the linker's machine size is small
+          n->bytes += fprintf(out, "%d", len);
+          for (k = 0; k<len; k++){
+               mode = pickMode(o->mix);
+               if (mode == 'E' && useCount == 0){
+                    mode = 'I'; //Nothing to refer to
+               }
+               op = randomBelow(10) * scale;
+               switch (mode){
+               case 'I':
+                    op += randomBelow(1000);
+                    if (chance(o->faults)){
+                         op = 10*scale + randomBelow(1000);
+                    }
+                    break;
+               case 'E':
+                    op += randomBelow(useCount);
+                    if (chance(o->faults)){
+                         op = op - op % scale + useCount + randomBelow(5);
+                    }
+                    break;
+               case 'A':
+                    op += randomBelow(512);
+                    if (chance(o->faults)){
+                         op = randomBelow(2) ? op - op % scale + 600 : 10*scale + randomBelow(1000);
+                    }
+                    break;
+               case 'R':
+                    op += randomBelow(len);
+                    if (chance(o->faults)){
+                         target = len + 1 + randomBelow(5);
+                         op = op - op % scale + (target > scale - 1 ? scale - 1 : target);
+                    }
+                    break;
+               }
+               n->bytes += fprintf(out, " %c %lld", mode, op);
+          }
+          n->bytes += fprintf(out, "\n");
+          n->tokens += 1 + 2*len;
+          n->instrs += len;
+     }
+     if (o->parseError){ //A def without its rel addr, NUM_EXPECTED at EoF
+          n->bytes += fprintf(out, "1 broken\n");
+          n->tokens += 2;
+     }
+}
+
+int pickMode(int* mix){
+     static const char modes[4] = {'I', 'E', 'A', 'R'};
+     int r, i;
+     r = randomBelow(mix[0] + mix[1] + mix[2] + mix[3]);
+     for (i = 0; i<3 && r >= mix[i]; i++){
+          r -= mix[i];
+     }
+     return modes[i];
+}
+
+unsigned long long nextRandom(){
+     rngState ^= rngState << 13;
+     rngState ^= rngState >> 7;
+     rngState ^= rngState << 17;
+     return rngState;
+}
+
+int randomBelow(int n){
+     return n <= 0 ? 0 : (int)(nextRandom() % (unsigned long long)n);
+}
+
+int chance(double p){
+     return p > 0 && (nextRandom() >> 11) * (1.0 / 9007199254740992.0) < p;
+}
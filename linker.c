@@ -1,554 +1,4269 @@
-#include "stdio.h" //fopen, fclose, printf, getline
-#include "string.h" //strlen, strtok, strcpy
-#include "stdlib.h" //strtol, exit, free, malloc, realloc
-#include "ctype.h" //isdigit(), isalpha(), isalnum()
+#include "stdio.h" //fprintf
+#include "string.h" //strlen, strcmp, memcpy, memmove
+#include "stdlib.h" //exit, free, malloc, realloc
+#include "ctype.h" //isdigit(), isalpha(), isalnum(), isspace()
+#include "limits.h" //LONG_MAX, LONG_MIN
+#include "fcntl.h" //open
+#include "unistd.h" //read, close
+#include "errno.h" //errno, EINTR
+#include "sys/uio.h" //writev
+#include "getopt.h" //getopt_long
+#include "pthread.h" //pthread_create, mutexes for -j
+#include "setjmp.h" //setjmp, longjmp out of speculative parses
+#include "time.h" //clock_gettime for --stats
+#include "sched.h" //sched_yield while a --pipeline ring is briefly empty or full
+#include "sys/mman.h" //mmap, munmap, madvise
+#include "sys/stat.h" //fstat
+#include "dirent.h" //opendir, readdir for --batch directories
+#include "symindex.h" //IndexHeader, the --symbol-index file format
+
+#define OBJ_MAGIC "LNKOBJ2\n" //First 8 bytes of a binary object file
+#define OBJ_ALIGN 8 //Sections of an object file start at multiples of this
+#define CACHE_MAGIC "LNKCCH2\n" //First 8 bytes of a relink cache file
+#define ARCHIVE_MAGIC "LNKARC2\n" //First 8 bytes of a module archive
+#define USE_DEFINED 1 //UseDep flag, the use resolved to a defined symbol
+#define USE_USED 2 //UseDep flag, an E instruction referenced the use
+#define IMAGE_MAGIC "LNKIMG1\n" //First 8 bytes of a binary memory image
+#define IMAGE_SYM_MULTIPLE 1 //ImageSymbol flag, defined more than once (rule 2)
+#define IMAGE_SYM_USED 2 //ImageSymbol flag, an E instruction referenced it
+#define IMAGE_DIAG_OUTSIDE 0 //ImageDiag rule of a word left out of the image, a negative length moved its addr below 0
+
+//Adds to a --stats counter of a hot path event, tokens, lookups and allocations. The counters are only built
+//with -DLINK_STATS, otherwise STAT_ADD and LEX_COUNT are nothing at all. Atomic since relocation threads count too.
+#ifdef LINK_STATS
+#define STAT_ADD(ctx, field, n) do{ if ((ctx)->statsOn){ __atomic_add_fetch(&(ctx)->stats.field, (n), __ATOMIC_RELAXED); } }while(0)
+#define LEX_COUNT(lx, field) ((lx)->field += 1) //Counts in the lexer itself, summed into the link's stats after pass 1
+#else
+#define STAT_ADD(ctx, field, n) do{ }while(0)
+#define LEX_COUNT(lx, field) ((void)0)
+#endif
+//Adds the time since start to a --stats phase time, phases are timed in every build, once per phase or module
+#define STAT_TIME(ctx, field, start) do{ if ((ctx)->statsOn){ __atomic_add_fetch(&(ctx)->stats.field, nowNanos() - (start), __ATOMIC_RELAXED); } }while(0)
+
+//Link status, returned by linkFiles, linkBuffer and convertFiles
+#define LINK_OK 0 //Linked, all output went to the sink
+#define LINK_PARSE_ERROR 1 //Input has a parse error, the message is the last line of the output
+#define LINK_BAD_OBJECT 2 //An object input is damaged, see LinkContext.error
+#define LINK_IO_ERROR 3 //The output sink or a file write failed, see LinkContext.error
+
+#ifndef PARALLEL_PASS_ONE_MIN
+#define PARALLEL_PASS_ONE_MIN (1 << 20) //Inputs smaller than this are parsed serially even with -j
+#endif
+#ifndef CONCURRENT_DEFINE_MIN
+#define CONCURRENT_DEFINE_MIN (1 << 14) //Batches of fewer defs are added to the symbol table serially even with -j
+#endif
+#ifndef RING_SIZE
+#define RING_SIZE (1 << 20) //Bytes in each ring of a --pipeline link, a power of 2
+#endif
+#define READ_BLOCK (1 << 18) //Most bytes the reader stage of a --pipeline link reads at once
+#define TOKEN_EOF -1 //TokenRecord len after the last token
+#define TOKEN_WRAP -2 //TokenRecord len of padding, the next record is at the start of the ring
+#if defined(__x86_64__) && !defined(NO_SIMD_SCAN) //-DNO_SIMD_SCAN builds with the scalar scanners only
+#define SIMD_SCAN 1
+#include "immintrin.h" //SSE2 and AVX2 compares for the token scanners
+#endif
 
 //Definitions
+typedef struct LinkContext LinkContext;
+
 typedef struct{
      int baseAddr; //base addr (X+1) = baseAddr(X) + len(X)
      int id;
+     int outIndex; //Memory map row of its first instruction, the instructions of the modules before it
      // length = code count, module size = length - 1
 }Module;
 
+typedef struct ArenaBlock{
+     struct ArenaBlock* next; //Next block, kept across resets for reuse
+     size_t size; //Usable bytes in data
+     size_t used; //Bytes handed out from data
+     char data[]; //Memory handed out by arenaAlloc
+}ArenaBlock;
+
+typedef struct{
+     ArenaBlock* first; //First block, start of the chain
+     ArenaBlock* cur; //Block allocations are served from
+     size_t blockSize; //Size of the next block to malloc, doubles up to a cap
+     long allocs; //arenaAlloc calls served
+     long blocks; //Blocks malloc'd
+     long bytes; //Bytes malloc'd for blocks
+     long resets; //resetArena calls
+}Arena;
+
 typedef struct{
-     char* sym; //Symbol, just a char array
-     int absAddr; //absaddr = relative addr + module base addr
-     int relAddr; //relative addr
-     int definedAlready; //Was this symbol defined already
-     int used; //Was this symbol used
-     Module mod; //Meta info for module this symboled defined in
-}Symbol;
+     long long tokens; //Tokens pass 1's lexers returned, speculative parses with -j included, LINK_STATS builds
+     long long lines; //Lines those lexers read, LINK_STATS builds
+     long long modules; //Modules linked, set after pass 1
+     long long instrs; //Instructions relocated, set after pass 1
+     long long symbols; //Symbol table size, set after pass 1
+     long long lookups; //findSymbolInTable calls, LINK_STATS builds
+     long long compares; //Occupied slots those lookups looked at, LINK_STATS builds
+     long long symbolAllocs; //Symbols added to a table, LINK_STATS builds
+     long long tableAllocs; //createSymbolTable calls, LINK_STATS builds
+     long long passOneNanos; //Pass 1, rule 5 checks included
+     long long rule5Nanos; //rule5Violation calls
+     long long symtabNanos; //Printing the symbol table
+     long long relocateNanos; //Relocating all modules and writing them out, rule 7 checks included
+     long long rule7Nanos; //rule7Violation calls, summed over threads
+     long long rule4Nanos; //rule4Violation
+     long long passTwoNanos; //Pass 2 up to the last byte written
+}LinkStats;
 
+//A symbol is its index in the table, its fields are kept in parallel arrays so the rule checks
+//and the table print sweep them in order instead of chasing a pointer per symbol
 typedef struct{
-     int cap; //symbolList capacity
-     int size; //symbolList curr size
-     Symbol** symbolList; //Symbol array
+     Arena* arena; //Owner of the arrays below, NULL when they live on the heap
+     int cap; //Capacity of the per symbol arrays
+     int size; //Symbol count, symbols are kept in insertion order for printing
+     char* names; //String pool, the symbol names back to back, each null terminated
+     int namesCap; //names capacity
+     int namesSize; //Bytes of names in use
+     int* nameAt; //Per symbol, offset of its name in names
+     unsigned int* hashes; //Per symbol, precomputed hash of its name, used by the index
+     int* absAddr; //Per symbol, absaddr = relative addr + module base addr
+     int* relAddr; //Per symbol, relative addr
+     int* modId; //Per symbol, module it was defined in
+     int* modBase; //Per symbol, base addr of that module
+     unsigned char* used; //Bit per symbol, was this symbol used
+     unsigned char* definedAlready; //Bit per symbol, was this symbol defined already
+     int hashCap; //hashSlots capacity, always a power of 2
+     int* hashSlots; //Open addressing index into the arrays, -1 = empty slot
+     LinkStats* stats; //Lookups are counted here for --stats, NULL when off
 }SymbolTable;
 
+#define SYM_NAME(st, i) ((st)->names + (st)->nameAt[i]) //Name of symbol i
+#define BIT_TEST(bits, i) (((bits)[(i) >> 3] >> ((i) & 7)) & 1)
+#define BIT_SET(bits, i) ((bits)[(i) >> 3] |= (unsigned char)(1 << ((i) & 7)))
+
+typedef struct{
+     int sym; //Offset of the symbol in Program.strings
+     int relAddr; //Relative addr as written in the def list
+}Def;
+
+typedef struct{
+     Module mod; //Base addr and id of the module
+     int defStart; //Index of first def in Program.defs
+     int defCount; //Number of defs in def list
+     int useStart; //Index of first use in Program.uses
+     int useCount; //Number of symbols in use list
+     int instrStart; //Index of first instruction in Program.modes/words
+     int instrCount; //Number of instructions
+     int length; //Module length as read, a negative length moves later modules back
+}ModuleIR;
+
+typedef struct{
+     int modCap, modCount; //modules capacity and size
+     ModuleIR* modules; //Module array, in input order
+     int defCap, defCount; //defs capacity and size
+     Def* defs; //Def lists of all modules, back to back
+     int useCap, useCount; //uses capacity and size
+     int* uses; //Use lists of all modules, offsets into strings
+     int instrCap, instrCount; //modes/words capacity and size
+     char* modes; //Address mode of every instruction, 'I','E','A','R'
+     int* words; //Instruction word of every instruction
+     long long* wide; //Instruction words of a large mode program, in place of words
+     int strCap, strSize; //strings capacity and size
+     char* strings; //Pool of null terminated symbol names
+     int mapped; //Lists point into a loaded object file and are not owned
+}Program;
+
+//Names of a batch of defs, inserted from several threads at once without a lock.
+//A slot holds the lowest def (in module order) with its name seen so far, a CAS puts a def in an
+//empty slot or replaces a higher def of the same name, so a slot never changes name once taken.
+//What stays in the slots when all inserts are done is what inserting in module order gives.
+typedef struct{
+     int cap; //slots capacity, a power of 2
+     int* slots; //Def index + 1, 0 = empty slot
+     const char* strings; //String pool of the defs
+     const Def* defs; //Defs of the program
+     int first; //First def of the batch, the arrays below are indexed from it
+     unsigned int* hashes; //Per def, hash of its name, written before the def is inserted
+     int* owner; //Per def, symbol table index of its name, -1 when the table did not have it
+     unsigned char* dup; //Per def, set when a lower def has the same name
+}ConcurrentTable;
+
+typedef struct{
+     pthread_t tid; //Thread running defineWorkerMain
+     ConcurrentTable* table; //Batch being defined
+     SymbolTable* symTable; //Symbols defined before the batch, read only while it runs
+     int begin, end; //Defs this thread inserts
+}DefineWorker;
+
+//Binary object file, a header followed by sections in this order:
+//modules (ModuleIR records, mod left zero), defs (Def records), uses (string offsets),
+//modes (one byte per instruction), words (one int per instruction), strings (interned names).
+//Native byte order, every section 8 byte aligned so the file maps straight into a Program.
+typedef struct{
+     char magic[8]; //OBJ_MAGIC
+     int moduleCount; //Records in the module section
+     int defCount; //Records in the def section
+     int useCount; //Records in the use section
+     int instrCount; //Records in the modes and words sections
+     int strSize; //Bytes in the string section
+     int totalInstr; //Sum of module lengths, checked against 512 when loading
+     long long moduleOff, defOff, useOff, modeOff, wordOff, strOff; //Section offsets from the start of the file
+}ObjHeader;
+
+//Binary memory image, what --image writes instead of the text output.
+//A header followed by sections in this order: words (one int per address from 0, the relocated
+//memory map), symbols (ImageSymbol records, symbol table order), strings (symbol names, null
+//terminated), diags (ImageDiag records, in the order the text output prints the errors and warnings).
+//Native byte order, every section 8 byte aligned like an object file.
+typedef struct{
+     char magic[8]; //IMAGE_MAGIC
+     int wordCount; //Words in the word section, addresses 0 to wordCount-1
+     int symbolCount; //Records in the symbol section
+     int diagCount; //Records in the diag section
+     int strSize; //Bytes in the string section
+     long long wordOff, symbolOff, diagOff, strOff; //Section offsets from the start of the file
+}ImageHeader;
+
+typedef struct{
+     int name; //Offset of the symbol name in the string section
+     int absAddr; //Abs addr as in the symbol table
+     int module; //Module the symbol was defined in
+     int flags; //IMAGE_SYM_ flags
+}ImageSymbol;
+
+typedef struct{
+     int rule; //Rule number broken, as in the text output's messages, or IMAGE_DIAG_OUTSIDE
+     int addr; //Abs addr of the instruction for instruction errors, -1 for symbol errors and warnings
+     int module; //Module the message is about
+     int name; //Offset of the symbol name in the string section, -1 when the message names none
+}ImageDiag;
+
+//Module archive, what --make-archive writes and --archive links from. The modules laid out like
+//an object file, then symbols (ArchiveSymbol per defined name, the first module defining it) and
+//hash (open addressing over the symbols by name, hashCap slots of a symbol index, -1 = empty slot,
+//linear probing from hashString & (hashCap-1)). Modules are only linked when a use needs them.
+typedef struct{
+     ObjHeader obj; //Sections of the archived modules, magic is ARCHIVE_MAGIC
+     int symbolCount; //Records in the symbol section
+     int hashCap; //Slots in the hash section, a power of 2 at least twice symbolCount
+     long long symbolOff, hashOff; //Section offsets from the start of the file
+}ArchiveHeader;
+
+typedef struct{
+     int name; //Offset of the symbol name in the string section
+     int module; //Archived module that defines it, the first when several do
+     unsigned int hash; //hashString of the name
+}ArchiveSymbol;
+
+typedef struct{
+     struct iovec iov[24]; //Sections and the padding after them, in file order
+     int count; //Used entries of iov
+     long long off; //File offset of the next section
+}SectionList;
+
+typedef struct Pipeline Pipeline;
+
+//Single producer single consumer byte ring between two --pipeline stages.
+//head and tail only grow, byte n lives at data[n & (cap-1)]. Each side works on its own
+//position and publishes it now and then, before it waits and when it is done.
+typedef struct{
+     char* data; //cap bytes
+     long cap; //Size of data, a power of 2
+     long head; //Bytes the consumer is done with, published
+     long tail; //Bytes the producer wrote, published
+     long readAt; //Consumer's position, only the consumer touches it
+     long writeAt; //Producer's position, only the producer touches it
+     int closed; //Producer published its last bytes
+     int abandoned; //Consumer stopped, the producer gives up
+     int sleepers; //Threads blocked in ringWait, woken under lock
+     pthread_mutex_t lock; //Only taken to sleep and to wake sleepers
+     pthread_cond_t cond; //Signalled when head, tail, closed or abandoned change and someone sleeps
+}ByteRing;
+
+//Token passed from the lexer stage to the pass logic, the token bytes follow it in the ring
+//padded to 16 bytes, or a pointer to a malloc'd copy follows when the token is spilled.
+typedef struct{
+     int len; //Token length, or TOKEN_EOF, TOKEN_WRAP
+     int linenum; //Line number of the token, of the last line at EoF
+     int lineoffset; //Line offset of the token, just past the last token at EoF
+     int spilled; //Token was too big for the ring, the bytes are in a malloc'd copy
+}TokenRecord;
+
+typedef struct{
+     int fd; //Input file descriptor
+     char* buf; //Input bytes, the whole mapping or a read buffer
+     long size; //Valid bytes in buf
+     long cap; //Read buffer capacity, 0 when buf is mmap'd
+     long base; //File position of buf[0], moves when the read buffer is refilled
+     long pos; //Scan position in buf
+     long lineStart; //File position of the first char of the current line
+     int eof; //No more bytes past buf+size
+     int inLine; //Current line may still have tokens
+     int linenum; //Current line number, counts lines read like getline did
+     int lineoffset; //Current line offset, 1 based column of the last token
+     int finalPosition; //Offset just past the last token of the current line
+     jmp_buf* onError; //Parse errors longjmp here instead of exiting, for speculative parses
+     const char* name; //Input name for parse errors, NULL when it is the only input
+     LinkContext* ctx; //Link reading the input, parse errors end it
+     int borrowed; //buf belongs to the caller, see initLexerBuffer
+     long blockStart, blockEnd; //Range of buf the masks below describe, at most 64 bytes, empty when not set
+     unsigned long long delimBits; //Bit per byte of the block, set for ' ', '\t', '\n', '\0'
+     unsigned long long blankBits; //Bit per byte of the block, set for ' ', '\t'
+     Pipeline* source; //Refills from the pipeline's reader stage instead of fd, see pipelineRead
+     Pipeline* stream; //Tokens come from the pipeline's lexer stage, see streamToken
+     char* spilled; //Spilled token returned last, freed at the next one
+     long long tokens, lines; //Returned and read by getToken, only counted with -DLINK_STATS, see LEX_COUNT
+}Lexer;
+
+//Stages of a --pipeline link, see passOnePipelined
+struct Pipeline{
+     Lexer* input; //The input's lexer, runs on the lexer stage
+     ByteRing raw; //Input bytes, reader stage to lexer stage
+     ByteRing tokens; //TokenRecords, lexer stage to pass 1
+     pthread_t reader; //Thread running readerStageMain
+     pthread_t lexer; //Thread running lexerStageMain
+     int reading; //reader was started
+};
+
+typedef struct{
+     const char* name; //File name as given, NULL for stdin
+     Lexer lex; //Kept open until the link is done, tokens and object lists point into it
+     Lexer start; //Lexer before parsing, to parse the file again on this thread
+     Program* prog; //Modules parsed ahead, not yet numbered or defined
+     int ok; //Parsed without errors, otherwise it is parsed again serially for the error
+     int object; //Object file, prog points into lex
+}InputFile;
+
+//An archive a link pulls modules from, opened by openArchives
+typedef struct{
+     const char* path; //File as given, NULL until the file is open
+     Lexer lex; //Holds the file, the lists below point into it
+     Program prog; //Archived modules
+     const ArchiveSymbol* symbols; //Symbol section
+     const int* slots; //Hash section
+     int hashCap; //Slots in the hash section
+     int symbolCount; //Records in the symbol section
+     unsigned char* pulled; //Per archived module, linked already
+}Archive;
+
+typedef struct{
+     InputFile* files; //Inputs in command line order
+     int count; //Number of inputs
+     int next; //Next file to claim, atomic
+}FileQueue;
+
+typedef struct{
+     int baseAddr; //Base addr of the next module
+     int moduleId; //Id of the next module
+     int totalInstr; //Counts total instr, <512
+     int outIndex; //Memory map row of the next module, differs from baseAddr after a negative length
+}PassOne;
+
+typedef struct{
+     pthread_t tid; //Thread running parseChunk
+     Lexer* src; //Whole input, shared read only
+     long begin; //First byte of the chunk, always a line start
+     long end; //Modules starting at or after end belong to later chunks
+     long newlines; //Newlines in [begin, end), for line numbers
+     long first; //Position of the first module's first token, -1 when speculation failed
+     long next; //Position of the first token after the last module, LONG_MAX at EoF
+     long maxTries; //Tokens of the longest module the limits allow, a real start is never further away
+     Program* prog; //Modules parsed speculatively, not yet numbered or defined
+     long* starts; //Position of each module's first token
+     int startCap; //starts capacity
+     long long tokens, lines; //Counts of the chunk's lexers, added to the input's lexer after the merge
+}Chunk;
+
+typedef int (*LinkSink)(void*, const char*, size_t); //Takes link output, returns 0, or -1 to fail the link
+
+typedef struct{
+     char* data; //Formatted output
+     size_t size; //Bytes used
+     size_t cap; //Bytes allocated
+     int fd; //Flushed to this fd when full, -1 for buffers that only grow or have a sink
+     LinkSink sink; //Flushed to this instead of fd when set
+     void* sinkArg; //First argument of sink
+     long long written; //Bytes flushed so far
+     int failed; //A flush failed, later output is dropped
+}OutBuf;
+
+//Relink cache file, the modules of the last link laid out like an object file,
+//then entries (CacheEntry per module), deps (UseDep per use) and out (each module's memory map lines).
+typedef struct{
+     ObjHeader obj; //Sections of the cached modules, magic is CACHE_MAGIC
+     int entryCount; //Records in the entry section, one per module
+     int depCount; //Records in the dep section, one per use
+     long long outSize; //Bytes in the out section
+     long long entryOff, depOff, outOff; //Section offsets from the start of the file
+}CacheHeader;
+
+typedef struct{
+     unsigned long long hash; //Hash of the module text, first token to last
+     long long outStart; //Offset of the module's output in the out section
+     int textLen; //Bytes of module text
+     int outLen; //Bytes of output
+     int baseAddr; //Base addr the output was relocated at
+     int moduleId; //Module number the output was made with, warnings name it
+     int outIndex; //Memory map row the output starts at
+}CacheEntry;
+
+typedef struct{
+     int absAddr; //Abs addr the use resolved to, 0 when not defined
+     int flags; //USE_DEFINED, USE_USED
+}UseDep;
+
+typedef struct{
+     char* map; //Cache file mapping, NULL when there was no usable cache
+     long mapSize; //Bytes mapped
+     Program* prog; //Modules of the last link, lists point into map
+     CacheEntry* entries; //Per module of prog
+     int entryCount; //Modules in prog
+     UseDep* deps; //Per use of prog
+     char* out; //Output of the modules of prog
+     int* index; //Open addressing over entries by text hash, -1 = empty slot, built on the first lookup off the fast path
+     int indexCap; //index capacity, a power of 2
+     int* hitOf; //Per module of the link, module of prog it was copied from, -1 when parsed
+     int hitCap; //hitOf capacity
+     CacheEntry* newEntries; //Per module of the link, saved as the next cache
+     int entryCap; //newEntries capacity
+     UseDep* newDeps; //Per use of the link
+     int depCap; //newDeps capacity
+     OutBuf newOut; //Output of every module of the link
+     int changed; //Some module was parsed, moved or relocated, the cache needs rewriting
+}LinkCache;
+
+typedef struct RelocQueue RelocQueue;
+
+typedef struct{
+     int base; //Module base addr, R operands are relative to it
+     int moduleSize; //Module length, larger R operands break rule 9
+     int useSize; //Use list length, larger E operands break rule 6
+     const int* useAddr; //Per use list symbol, abs addr it resolves to, 0 when not defined
+     const int* useGlobal; //Per use list symbol, symbol table index, -1 when not defined
+     int* useHits; //Per use list symbol, E instructions that referenced it, counted by relocateInstrs
+     long long scale; //Large mode, 10^operandWidth, a word is opcode*scale + operand
+     long long machineSize; //Large mode, A operands from here on break rule 8
+}RelocKernel;
+
+typedef struct{
+     pthread_t tid; //Thread running relocWorkerMain, unused in serial mode
+     RelocQueue* queue; //Where the thread claims modules, unused in serial mode
+     Arena scratch; //Use lists of the modules this worker relocates, reset between modules
+     unsigned char* usedBits; //Bit per symbol of the link, set when an E instruction uses it
+     int* useUsed; //When set, per use of the module, set to 1 when an E instruction references it
+     LinkContext* ctx; //Link the worker relocates for
+}RelocWorker;
+
+struct RelocQueue{
+     pthread_mutex_t lock; //Guards everything below
+     pthread_cond_t cond; //Signalled when a module is done or written
+     int next; //Next module to claim
+     int written; //Modules written to the link output so far
+     int window; //How far workers may run ahead of the writer
+     OutBuf* slots; //Output of modules [written, written+window), indexed by module % window
+     int* done; //Per slot, module output is complete
+};
+
+//Everything one link works on, links in different contexts can run at once on different threads.
+//Options are set between createLinkContext and the link, a context runs one link.
+struct LinkContext{
+     SymbolTable* symTable; //Symbol table to be shared in passes
+     Program* program; //Modules recorded in pass 1, relocated in pass 2
+     Arena arena; //Owns every symbol defined in pass 1, freed with the context
+     OutBuf out; //All link output goes through here, to out.fd or out.sink
+     OutBuf* report; //Where the symbol table, memory map and warnings go, &out, or &diags when writing an image
+     OutBuf diags; //ImageDiag records of an image link, in output order
+     Arena scratchAllocs; //Counts of all relocation scratch arenas, summed as workers finish
+     LinkCache* cache; //Relink cache, NULL without cachePath
+     const char* cachePath; //Option, relink cache file to read and rewrite, NULL for none
+     const char* imagePath; //Option, binary image file to write instead of the text output, NULL for text
+     int imageFd; //Image file being written, -1 when none
+     char* imageMap; //Mapping of the image up to its diag section, NULL when not mapped
+     size_t imageMapSize; //Bytes mapped
+     int* image; //Word section inside imageMap, relocation writes here
+     int imageWords; //Words in the word section
+     const char* indexPath; //Option, symbol index file to write after the link, NULL for none
+     const char** archivePaths; //Option, archives to pull modules from in search order, see pullArchiveModules
+     int archiveCount; //Entries in archivePaths
+     Archive* archives; //Archives opened for the link, NULL until pass 1 needs them
+     int archive; //Option, convertFiles writes a module archive instead of an object file
+     int jobs; //Option, parser and relocation threads
+     int pipeline; //Option, reads, tokenizes and parses a single text input on three threads, see passOnePipelined
+     int large; //Option, large image mode, set with setLargeMode, text inputs and output only
+     long long machineSize; //Large mode, addresses of the machine, A operands past it break rule 8
+     int operandWidth; //Digits of an operand, 3 in classic mode, words are opcode*10^operandWidth + operand
+     long long operandScale; //10^operandWidth
+     int addrWidth; //Large mode, digits of the last machine address, memory map addresses are padded to it
+     char illegalWord[20]; //Large mode, all nines word an illegal opcode or immediate is replaced with
+     int maxDefs, maxUses; //Def and use list limits, 16 in classic mode
+     int maxInstr; //Total instruction limit, 512 in classic mode
+     int statsOn; //Option, --stats counters below are only touched when set
+     LinkStats stats; //--stats counters and phase times
+     jmp_buf* onFatal; //Where failLink jumps, set while a link runs
+     int status; //LINK_ status of the link
+     char error[256]; //Why the link failed, empty when it worked or the reason is in the output
+};
+
+//One input of a --batch run, linked on its own context by whichever worker claims it
+typedef struct{
+     const char* name; //Input file as listed
+     char* outPath; //File the output goes to, NULL when it goes in the combined stream
+     OutBuf out; //Output for the combined stream, only grows, written in list order
+     int status; //LINK_ status of the link
+     char error[256]; //Why the link failed when the output does not say, empty otherwise
+     int done; //Linked, guarded by the queue lock
+}BatchJob;
+
+typedef struct{
+     pthread_mutex_t lock; //Guards everything below
+     pthread_cond_t cond; //Signalled when a job is done or written
+     BatchJob* jobs; //Inputs in list order
+     int count; //Number of jobs
+     int next; //Next job to claim
+     int written; //Jobs written out so far
+     int window; //How far workers may run ahead of the writer
+     LinkContext* options; //Options every job's context copies, large mode and archives
+}BatchQueue;
+
 //Global variables
-FILE* fptr; //File pointer
-SymbolTable* mySymTable; //Symbol table to be shared in passes
-int linenum; //Current line number
-int lineoffset; //Current line offset
+void (*classifyBytes)(const char*, unsigned long long*, unsigned long long*); //Fastest classify* this CPU runs, set by selectScanners before main
+long heapAllocs; //malloc/realloc calls made outside the arenas by every link, for --alloc-stats
 
 //Functions
+//Library, the CLI in main() is a thin wrapper
+LinkContext* createLinkContext(); //Allocates a context for one link, 1 job, no cache, no --stats, output only buffered
+void destroyLinkContext(LinkContext*); //Frees the context and everything its link made
+int linkFiles(LinkContext*, InputFile*, int); //Links opened inputs in order, returns a LINK_ status
+int linkBuffer(LinkContext*, const char*, size_t, LinkSink, void*); //Links one input held in memory, output goes to the sink
+int convertFiles(LinkContext*, InputFile*, int, const char*); //Writes opened text inputs as one object file or archive, returns a LINK_ status
+int setLargeMode(LinkContext*, long long, int); //Switches a context to large mode with a machine size and operand width, 0 when they do not fit
+void failLink(LinkContext*, int, const char*, const char*); //Ends the running link with a status, see definition
+
+//Batch
+int linkBatch(LinkContext*, BatchJob*, int, int); //Links every job on its own context, ctx->jobs at once, frames the outputs to an fd, returns the failed count
+void* batchWorkerMain(void*); //Thread body, claims jobs from a BatchQueue
+void linkBatchJob(LinkContext*, BatchJob*); //Links one job's input with the options of a context
+int batchSink(void*, const char*, size_t); //LinkSink, appends to a job's OutBuf
+char** readBatchList(const char*, int*); //Input names of a manifest or a directory, takes the path and returns the count
+int compareNames(const void*, const void*); //qsort order of a directory's names
+const char* duplicateOutPath(BatchJob*, int); //An output path two jobs share, NULL when they all differ
+
+//Arenas
+void initArena(Arena*, size_t); //Sets up an empty arena, takes the first block size
+void* arenaAlloc(Arena*, size_t); //Bump allocates from the arena, exit() on failure
+void resetArena(Arena*); //Hands all memory back to the arena, keeps the blocks
+void freeArena(Arena*); //Frees every block of the arena
+void printAllocStats(LinkContext*); //Prints arena and heap allocation counts to stderr
+long long nowNanos(); //Monotonic clock in nanoseconds, for --stats
+void printStats(LinkContext*); //Prints the --stats report to stderr
+
 //Symbols
-Symbol* createSymbol(char*,Module); //Allocates a symbol struct on heap
-void deallocSymbol(Symbol*); //Deallocs a symbol struct on heap
-void printSymbol(Symbol*); //Prints the symbol, sym=val, and rule 2 violation
+void printSymbol(OutBuf*, SymbolTable*, int); //Prints the symbol, sym=val, and rule 2 violation
 
 //SymbolTable
-SymbolTable* createSymbolTable(); //Allocates SymbolTable on heap
+SymbolTable* createSymbolTable(Arena*, int, LinkStats*); //Allocates SymbolTable in the arena, or on heap when NULL, sized for the given symbol count, counts for --stats when given
+void* tableRealloc(SymbolTable*, void*, size_t, size_t, const char*); //Grows a table array in its arena or on heap
+void growSymbolTable(SymbolTable*, int); //Grows the per symbol arrays to the given capacity
 void deallocSymbolTable(SymbolTable*); //Deallocs the symbol table
-void printSymbolTable(SymbolTable*); //Prints symbol table with titles
-void addSymbolToTable(SymbolTable*, Symbol*); //Adds symbol to table
-Symbol* findSymbolInTable(SymbolTable*, char*); //Finds symbol in table
-void printSymbolTableSyms(SymbolTable* st); //Prints symbol table without tiles
+void printSymbolTable(OutBuf*, SymbolTable*); //Prints symbol table with titles
+int addSymbolToTable(SymbolTable*, const char*, Module, int); //Adds symbol with its module and rel addr, returns its index, -1 when defined already
+int appendSymbol(SymbolTable*, const char*, unsigned int, Module, int); //Adds a symbol known not to be in the table, hash already computed, returns its index
+int findSymbolInTable(SymbolTable*, const char*); //Finds symbol in table, returns its index or -1
+int findSymbolHashed(SymbolTable*, const char*, unsigned int); //Finds symbol in table, hash already computed
+void growSymbolTableIndex(SymbolTable*); //Doubles hashSlots and rehashes all symbols
+unsigned int hashString(const char*); //FNV-1a hash of a symbol string
+void printSymbolTableSyms(OutBuf*, SymbolTable* st); //Prints symbol table without tiles
+
+//Program
+Program* createProgram(); //Allocates an empty Program on heap
+void deallocProgram(Program*); //Deallocs the program and all its lists
+ModuleIR* addModuleToProgram(Program*, Module); //Appends an empty module, returns it
+void copyModuleToProgram(Program*, Program*, ModuleIR*); //Appends a module of another program
+void addDefToProgram(Program*, ModuleIR*, const char*, int, int); //Appends a def (symbol, length, rel addr) to the last module
+void addUseToProgram(Program*, ModuleIR*, const char*, int); //Appends a use (symbol, length) to the last module
+void addInstrToProgram(Program*, ModuleIR*, char, int); //Appends an instruction to the last module
+void addWideInstrToProgram(Program*, ModuleIR*, char, long long); //Appends a large mode instruction to the last module
+int addStringToProgram(Program*, const char*, int); //Copies a string of given length into the pool, returns its offset
+void* growArray(void*, int*, int, const char*); //Doubles an array capacity, exit() on failure
+
+//Object files
+int isObjectInput(Lexer*); //Checks the input for OBJ_MAGIC, reads the header of piped input to see it
+void loadObject(LinkContext*, Lexer*, Program*, const char*); //Points the program into the object in memory, fails the link if malformed
+int mapObject(char*, long, Program*); //Points the program into an object in memory, 0 if malformed
+int sectionFits(long long, long long, long long, long); //Checks count records of a size at an offset lie in a file of total bytes
+void passOneObject(LinkContext*, Lexer*, const char*); //First pass over an object file, no tokens to parse
+void checkObjectModule(LinkContext*, PassOne*, ModuleIR*, const char*); //Fails the link if an object module breaks the text limits
+void convertToObject(LinkContext*, InputFile*, int, const char*); //Parses text inputs and writes them as one object file, or an archive
+int internString(Program*, int*, int, const char*); //Adds a string to a pool once, see definition
+void addSection(SectionList*, long long*, const void*, size_t); //Appends a section to a file being written, sets its offset, pads it
+
+//Module archives
+void openArchives(LinkContext*); //Maps every archive of the link and checks its index, fails the link if one is malformed
+void closeArchives(LinkContext*); //Unmaps the archives
+void pullArchiveModules(LinkContext*); //Links the archived modules the link's uses need, transitively, after the input's modules
+int findArchiveSymbol(Archive*, const char*, unsigned int); //Symbol record of a name in an archive, -1 when it defines none
+
+//Binary image
+void openImage(LinkContext*); //Creates and maps the image file sized from pass 1, adds rule 2 diags
+void closeImage(LinkContext*); //Fills in the header, symbols and names, unmaps, appends the diags
+void addDiag(OutBuf*, int, int, int, int); //Appends an ImageDiag record (rule, addr, module, name) to a buffer
+
+//Symbol index
+void writeSymbolIndex(LinkContext*); //Writes the symbols and modules of the link sorted by address, with a name hash, see IndexHeader
+int compareIndexSymbols(const void*, const void*); //qsort order of IndexSymbol, abs addr then definition order
+int compareIndexModules(const void*, const void*); //qsort order of IndexModule, base addr then id
+
+//Relink cache
+LinkCache* openCache(const char*); //Maps the cache file of the last link, an empty cache when there is none
+void closeCache(LinkCache*); //Unmaps the cache and frees what this link recorded
+void saveCache(LinkContext*); //Writes the modules of this link as the next cache
+int findCachedModule(LinkCache*, unsigned long long, int, Module); //Cached module with the same text, see definition
+int cacheSlot(LinkCache*, unsigned long long, int, Module, int); //Probes the cache index, see definition
+void indexCache(LinkCache*); //Builds the cache index
+unsigned long long hashBytes(const char*, long); //64 bit FNV-1a of a byte range
+int skimModule(Lexer*, long*, long*); //Finds the end of a module's text without checking it, see definition
+void passOneIncremental(LinkContext*, Lexer*, PassOne*); //First pass over one input, copies modules whose text is cached, parses the rest
+void passTwoIncremental(LinkContext*); //Second pass, reuses the output of modules whose base and uses did not change
 
 //Initalization
-void initGlobalVar(const char*); //Initalizes the global vars above, takes a filename
+void initLexer(Lexer*, const char*); //Maps the input file or prepares a read buffer, takes a filename, NULL or "-" for stdin
+void initLexerFd(Lexer*, int); //initLexer for a file already open
+void initLexerBuffer(Lexer*, const char*, long); //Reads input held in memory, see definition
+void closeLexer(Lexer*); //Unmaps or frees the input
+int refillLexer(Lexer*, long); //Reads more input keeping bytes from the given position, 0 on EoF
 
 //Token related
-char* getToken(); //Gets tokens from input file
+const char* getToken(Lexer*, int*); //Gets tokens from input, a view into the input and its length, NULL on EoF
+long scanBytes(Lexer*, long, int); //Position of the next delimiter, or non blank, at or after a position, see definition
+void classifyBlock(Lexer*, long); //Classifies the bytes from a position into the lexer's block masks
+void selectScanners(); //Points classifyBytes at the widest version the CPU has, runs before main
+void classifyScalar(const char*, unsigned long long*, unsigned long long*); //Delimiter and blank masks of 64 bytes
+#ifdef SIMD_SCAN
+void classifySse2(const char*, unsigned long long*, unsigned long long*); //classifyScalar 16 bytes at a time
+void classifyAvx2(const char*, unsigned long long*, unsigned long long*); //classifyScalar 32 bytes at a time
+#endif
 void tokenizer(const char* filename); //Takes a filename, opens it and prints its tokens using getToken()
 //Tokenizer() not used in pass 1 or 2, just made it for checking the parsing
-int readInt(); //Error checks, returns an integer, -1 on EoF, exit() on parse error
-char* readSym(); //Error checks, returns a string (symbol), exit() on parse error
-char readIEAR(); //Error checs, returns "I,A,E,R" chars, exit() on parse error
+int readInt(Lexer*); //Error checks, returns an integer, -1 on EoF, fails the link on parse error
+int parseIntToken(Lexer*, const char*, int); //Error checks a token already read, returns its integer
+long readLong(Lexer*); //readInt without truncating to int, for large mode
+long parseLongToken(Lexer*, const char*, int); //parseIntToken without truncating to int
+int saturateInt(long); //Clamps a value to the int range, large mode counts and addresses
+const char* readSym(Lexer*, int*); //Error checks, returns a symbol and its length, fails the link on parse error
+char readIEAR(Lexer*); //Error checs, returns "I,A,E,R" chars, fails the link on parse error
 
 //Passes
-void passOne(); //First pass
-void passTwo(); //Second pass
+void passOne(LinkContext*, InputFile*, int); //First pass, takes the inputs and their count
+void passOneFiles(LinkContext*, InputFile*, int); //First pass over several files, parsed on threads, merged in order
+void* parseFileMain(void*); //Thread body, claims files from a FileQueue
+void parseInputFile(InputFile*); //Parses a whole file ahead of the merge, errors are left for the merge
+int parseModule(Lexer*, Program*, int, long, long*); //Parses one module, syntax only, see definition
+void defineModule(LinkContext*, PassOne*, Program*, ModuleIR*); //Numbers a parsed module, adds its defs, checks rule 5
+void numberModule(PassOne*, ModuleIR*); //Sets a module's id and base, moves st on to the next module
+void addModuleDefs(LinkContext*, Program*, ModuleIR*); //Adds a numbered module's defs to the symbol table, checks rule 5
+void defineModules(LinkContext*, int, int); //Adds the defs of numbered modules [from, to) of ctx->program, on threads for big batches
+int instrBudget(LinkContext*, int); //Instructions the next module may have after a total so far
+long passOneRange(LinkContext*, Lexer*, PassOne*, long); //Parses and defines modules up to a position, returns where it stopped
+void passOneParallel(LinkContext*, Lexer*); //Parses chunks of the input speculatively on threads, then merges them
+void* parseChunk(void*); //Thread body, finds the first module in a chunk and parses up to the chunk end
+void positionLexer(Lexer*, Chunk*, int, long); //Moves a lexer to a token position, recounting lines
+void passTwo(LinkContext*); //Second pass, on ctx->jobs relocation threads
+
+//Pipelined pass 1
+void passOnePipelined(LinkContext*, Lexer*, PassOne*); //First pass with the reader, lexer and pass logic on their own threads
+void* readerStageMain(void*); //Thread body, reads the input into the raw ring
+void* lexerStageMain(void*); //Thread body, tokenizes the raw ring into the token ring
+long pipelineRead(Pipeline*, char*, long); //read() for the lexer stage, takes bytes from the raw ring, 0 on EoF
+int pushToken(Pipeline*, const char*, int); //Writes a TokenRecord with the input lexer's line and offset, 0 when pass 1 stopped
+const char* streamToken(Lexer*, int*); //getToken for pass 1, next token of the token ring
+long recordSize(const TokenRecord*); //Bytes a TokenRecord and its token take in the ring
+void streamLexer(Lexer*); //Reads a mapped input through a read buffer instead
+void initRing(ByteRing*, long); //Sets up an empty ring of the given size
+void freeRing(ByteRing*); //Frees the ring
+long ringSpace(ByteRing*, long); //Waits until the producer can write some bytes, returns how many, 0 when abandoned
+long ringData(ByteRing*); //Waits until the consumer can read some bytes, returns how many, 0 on EoF or when abandoned
+void ringPublish(ByteRing*, long*, long); //Publishes a side's position and wakes the other side
+void ringWait(ByteRing*, long*, long); //Blocks until a published position moves from a value, or the ring ends
+void ringEnd(ByteRing*, int*); //Sets closed or abandoned and wakes the other side
+
+//Concurrent symbol definition
+ConcurrentTable* createConcurrentTable(Program*, int, int); //Empty table for defs [first, first+count) of a program
+void deallocConcurrentTable(ConcurrentTable*); //Frees the table
+void concurrentInsert(ConcurrentTable*, int); //Inserts a def, the lowest def of a name keeps its slot, see definition
+int concurrentFind(ConcurrentTable*, const char*, unsigned int); //Lowest def with the name, -1 when none, hash already computed
+void* defineWorkerMain(void*); //Thread body, hashes and inserts a range of defs
+
+//Relocation
+void relocateModule(ModuleIR*, RelocWorker*, OutBuf*); //Relocates one module into a buffer, memory map and rule 7 warnings
+void relocateInstrs(const RelocKernel*, const char*, const int*, int, int*, signed char*); //Relocates a module's modes and words into words and error rules, see definition
+void relocateWide(const RelocKernel*, const char*, const long long*, int, long long*, signed char*); //relocateInstrs for large mode words
+void initRelocWorker(LinkContext*, RelocWorker*); //Sets up a worker's scratch arena and used bits
+void mergeRelocWorker(RelocWorker*); //Marks symbols the worker used, then frees the worker
+void relocateParallel(LinkContext*); //Relocates all modules on a thread pool, writes them in module order
+void* relocWorkerMain(void*); //Thread body, claims modules from the RelocQueue
+
+//Output
+void initOutBuf(OutBuf*, int); //Sets up an empty buffer, takes the fd it flushes to or -1, no sink
+char* outReserve(OutBuf*, size_t); //Makes room for bytes at the end, flushing or growing, returns where they go
+void outBytes(OutBuf*, const char*, size_t); //Appends bytes
+void outStr(OutBuf*, const char*); //Appends a null terminated string
+void outInt(OutBuf*, long long, int); //Appends an int zero padded to a width like %0*lld, width 0 is %lld
+void flushOutBuf(OutBuf*); //Writes a buffer to its fd or sink and empties it
+void writeOutBuf(OutBuf*, OutBuf*); //Moves a module's buffer to the link output and empties it
+void emitOutput(OutBuf*, struct iovec*, int); //Writes byte ranges to a buffer's fd or sink, marks it failed on error
+int writevAll(int, struct iovec*, int); //writev until everything is written, -1 on error
 
 //Errors
-void __parseerror(int); //Err code
-void __nonTerminatingError(int, char*); //Takes errcode, and a symbol
-void __warnings(int, int, Symbol*); //Takes errcode, module size, and a symbol
+void __parseerror(Lexer*, int); //Lexer for line/offset, err code
+void __nonTerminatingError(OutBuf*, int, char*); //Takes output, errcode, and a symbol, or the word of rules 10 and 11 in large mode
+void __warnings(OutBuf*, int, int, SymbolTable*, int); //Takes output, errcode, module size, and a symbol of the table
 
 //Warnings
-void rule5Violation(int, int); //Checks for rule 5 violation, called at end of module in pass 1
-void rule4Violation(); //Checks for rule 4 violation, called at end of pass 2
-void rule7Violation(SymbolTable*); //Checks for rule 7 violation, called at end of module in pass 2
+void rule5Violation(LinkContext*, int, int); //Checks for rule 5 violation, called at end of module in pass 1
+void rule4Violation(LinkContext*); //Checks for rule 4 violation, called at end of pass 2
+void rule7Violation(LinkContext*, OutBuf*, SymbolTable*, int*); //Checks for rule 7 violation, called at end of module in pass 2, takes use names for image diags
 
 int main(int argc, char *argv[]) {
-     //Should only be called with a single argument, filename
+     //Called with input files, linked as one image in order, reads stdin without any
+     //-j N parses and relocates on N threads, --alloc-stats reports allocation counts on stderr
+     //-c FILE converts the input to an object file instead of linking it, either format links
+     //--cache FILE relinks incrementally, only modules whose text, base or uses changed are redone
+     //--stats prints phase times and counters on stderr as name=value lines, see printStats()
+     //--image FILE writes the relocated memory as a binary image instead of printing the link, see ImageHeader
+     //--pipeline reads, tokenizes and parses a single input on three threads, see passOnePipelined
+     //--large, --machine-size N, --operand-width N link in large mode, see setLargeMode
+     //--symbol-index FILE also writes an address and name index of the symbols, symquery reads it
+     //--batch LIST links every input of a manifest or directory on its own, -j N at once, see linkBatch
+     //--batch-out DIR writes each batch output to DIR/name.out instead of one framed stream on stdout
+     //--make-archive FILE writes the input as a module archive instead of linking it, see ArchiveHeader
+     //--archive FILE links the archived modules the input uses after it, repeatable, see pullArchiveModules
      //tokenizer(argv[1]);
 
-     mySymTable = createSymbolTable(); //Create symbol table
-     initGlobalVar(argv[1]); //Init values and open file
-     passOne(); //Pass 1
-     fclose(fptr); //Close file
+     static struct option longOpts[] = {
+          {"alloc-stats", no_argument, NULL, 'a'},
+          {"jobs", required_argument, NULL, 'j'},
+          {"convert", required_argument, NULL, 'c'},
+          {"cache", required_argument, NULL, 'k'},
+          {"stats", no_argument, NULL, 's'},
+          {"image", required_argument, NULL, 'i'},
+          {"pipeline", no_argument, NULL, 'p'},
+          {"large", no_argument, NULL, 'L'},
+          {"machine-size", required_argument, NULL, 'M'},
+          {"operand-width", required_argument, NULL, 'W'},
+          {"symbol-index", required_argument, NULL, 'x'},
+          {"batch", required_argument, NULL, 'b'},
+          {"batch-out", required_argument, NULL, 'o'},
+          {"make-archive", required_argument, NULL, 'm'},
+          {"archive", required_argument, NULL, 'A'},
+          {NULL, 0, NULL, 0}
+     };
+     LinkContext* ctx; //The one link this run makes
+     InputFile* files; //Inputs in command line order
+     int fileCount, k, status;
+     int allocStats = 0;
+     const char* convertTo = NULL; //Object file to write
+     const char* batchList = NULL; //Manifest or directory of a batch
+     const char* batchOut = NULL; //Directory of the batch outputs, NULL for stdout
+     BatchJob* jobs; //Inputs of the batch
+     char** names;
+     const char* base;
+     int large = 0; //Large mode, sizes below when given
+     long long machineSize = 0, scale;
+     int operandWidth = 0;
+     char* end;
+     long n; //Number option, checked before it goes to an int
+     int opt;
+
+     ctx = createLinkContext();
+     while ((opt = getopt_long(argc, argv, "j:c:", longOpts, NULL)) != -1){
+          switch (opt){
+          case 'a':
+               allocStats = 1;
+               break;
+          case 'c':
+               convertTo = optarg;
+               break;
+          case 'k':
+               ctx->cachePath = optarg;
+               break;
+          case 's':
+               ctx->statsOn = 1;
+               break;
+          case 'i':
+               ctx->imagePath = optarg;
+               break;
+          case 'p':
+               ctx->pipeline = 1;
+               break;
+          case 'x':
+               ctx->indexPath = optarg;
+               break;
+          case 'b':
+               batchList = optarg;
+               break;
+          case 'o':
+               batchOut = optarg;
+               break;
+          case 'm':
+               convertTo = optarg;
+               ctx->archive = 1;
+               break;
+          case 'A':
+               if (ctx->archivePaths == NULL){ //At most one per argument
+                    ctx->archivePaths = (const char**)malloc(argc * sizeof(const char*));
+                    if (ctx->archivePaths == NULL){
+                         fprintf(stderr, "main:archivePaths Failed to allocate memory.\n");
+                         exit(-1);
+                    }
+               }
+               ctx->archivePaths[ctx->archiveCount++] = optarg;
+               break;
+          case 'L':
+               large = 1;
+               break;
+          case 'M':
+               large = 1;
+               machineSize = strtoll(optarg, &end, 10);
+               if (*end != '\0' || machineSize < 1){
+                    fprintf(stderr, "Invalid machine size: %s.\n", optarg);
+                    exit(-1);
+               }
+               break;
+          case 'W':
+               large = 1;
+               n = strtol(optarg, &end, 10);
+               if (*end != '\0' || n < 1 || n > INT_MAX){
+                    fprintf(stderr, "Invalid operand width: %s.\n", optarg);
+                    exit(-1);
+               }
+               operandWidth = (int)n;
+               break;
+          case 'j':
+               n = strtol(optarg, &end, 10);
+               if (*end != '\0' || n < 1 || n > INT_MAX){
+                    fprintf(stderr, "Invalid job count: %s.\n", optarg);
+                    exit(-1);
+               }
+               ctx->jobs = (int)n;
+               break;
+          default:
+               fprintf(stderr, "Usage: %s [-j N] [-c objectfile] [--cache file] [--image file] [--pipeline] [--large] [--machine-size N] [--operand-width N] [--symbol-index file] [--batch list [--batch-out dir]] [--make-archive file] [--archive file...] [--alloc-stats] [--stats] [inputfile...]\n", argv[0]);
+               exit(-1);
+          }
+     }
+     if (large){
+          if (operandWidth == 0){ //Narrowest operand for the machine size, at least 3 digits, 9 without a size
+               operandWidth = machineSize == 0 ? 9 : 3;
+               for (scale = 1000; scale < machineSize && operandWidth < 17; scale *= 10){
+                    operandWidth += 1;
+               }
+          }
+          if (machineSize == 0){ //Every address an operand can hold
+               for (machineSize = 1, k = 0; k<operandWidth && k<17; k++){
+                    machineSize *= 10;
+               }
+          }
+          if (convertTo != NULL || ctx->cachePath != NULL || ctx->imagePath != NULL || ctx->archiveCount > 0){
+               fprintf(stderr, "Large mode links text inputs to text output, -c, --cache, --image and archives do not apply.\n");
+               exit(-1);
+          }
+          if (!setLargeMode(ctx, machineSize, operandWidth)){
+               fprintf(stderr, "Invalid large mode sizes, the operand width is 1 to 17 digits and the machine size at most 10^width.\n");
+               exit(-1);
+          }
+     }
+     if (ctx->cachePath != NULL && ctx->archiveCount > 0){
+          fprintf(stderr, "--cache only relinks the input's modules, it does not apply with --archive.\n");
+          exit(-1);
+     }
+     if (batchList != NULL){
+          if (convertTo != NULL || ctx->cachePath != NULL || ctx->imagePath != NULL || ctx->indexPath != NULL || ctx->pipeline || ctx->statsOn || optind < argc){
+               fprintf(stderr, "--batch links the listed inputs to text output, inputs, -c, --cache, --image, --symbol-index, --pipeline and --stats do not apply.\n");
+               exit(-1);
+          }
+          names = readBatchList(batchList, &fileCount);
+          jobs = (BatchJob*)calloc(fileCount > 0 ? fileCount : 1, sizeof(BatchJob));
+          if (jobs == NULL){
+               fprintf(stderr, "main:jobs Failed to allocate memory.\n");
+               exit(-1);
+          }
+          for (k = 0; k<fileCount; k++){
+               jobs[k].name = names[k];
+               if (batchOut != NULL){ //Named after the input's last path component
+                    base = strrchr(names[k], '/') != NULL ? strrchr(names[k], '/') + 1 : names[k];
+                    jobs[k].outPath = (char*)malloc(strlen(batchOut) + strlen(base) + 6);
+                    if (jobs[k].outPath == NULL){
+                         fprintf(stderr, "main:outPath Failed to allocate memory.\n");
+                         exit(-1);
+                    }
+                    sprintf(jobs[k].outPath, "%s/%s.out", batchOut, base);
+               }
+          }
+          if (batchOut != NULL && (base = duplicateOutPath(jobs, fileCount)) != NULL){ //One would replace the other
+               fprintf(stderr, "--batch-out names each output after its input's file name, two inputs would write %s.\n", base);
+               exit(-1);
+          }
+          status = linkBatch(ctx, jobs, fileCount, batchOut != NULL ? -1 : 1); //Jobs that failed
+          for (k = 0; k<fileCount; k++){
+               free(names[k]);
+               free(jobs[k].outPath);
+          }
+          free(names);
+          free(jobs);
+          if (allocStats){
+               printAllocStats(ctx);
+          }
+          free(ctx->archivePaths);
+          destroyLinkContext(ctx);
+          return status == 0 ? 0 : -1;
+     }
+     ctx->out.fd = 1; //Link output goes to stdout
+     fileCount = optind < argc ? argc - optind : 1; //stdin without any
+     files = (InputFile*)calloc(fileCount, sizeof(InputFile));
+     if (files == NULL){
+          fprintf(stderr, "main:files Failed to allocate memory.\n");
+          exit(-1);
+     }
+     for (k = 0; k<fileCount; k++){
+          files[k].name = optind < argc ? argv[optind + k] : NULL;
+          initLexer(&files[k].lex, files[k].name); //Init values and open file
+          if (fileCount > 1){ //Parse errors say which file
+               files[k].lex.name = files[k].name == NULL ? "-" : files[k].name;
+          }
+     }
+     if (convertTo != NULL){
+          status = convertFiles(ctx, files, fileCount, convertTo);
+     } else{
+          status = linkFiles(ctx, files, fileCount); //Pass 1 and pass 2
+     }
+     if (ctx->error[0] != '\0'){
+          fprintf(stderr, "%s\n", ctx->error);
+     }
+     if (ctx->statsOn && convertTo == NULL){ //Parse errors get a report too
+          printStats(ctx);
+     }
+     for (k = 0; k<fileCount; k++){
+          closeLexer(&files[k].lex); //Close file, an object file's lists pointed into it
+     }
+     free(files);
+     if (allocStats && status == LINK_OK){
+          printAllocStats(ctx);
+     }
+     free(ctx->archivePaths);
+     destroyLinkContext(ctx); //Delete symbol table, module list and all symbols
+     return status == LINK_OK ? 0 : -1; //Done
+}
+
+LinkContext* createLinkContext(){
+     LinkContext* ctx = (LinkContext*)calloc(1, sizeof(LinkContext));
+     __atomic_add_fetch(&heapAllocs, 1, __ATOMIC_RELAXED);
+     if (ctx == NULL){
+          fprintf(stderr, "createLinkContext:ctx Failed to allocate memory.\n");
+          exit(-1);
+     }
+     ctx->jobs = 1;
+     ctx->machineSize = 512; //Classic mode limits
+     ctx->operandWidth = 3;
+     ctx->operandScale = 1000;
+     ctx->maxDefs = 16;
+     ctx->maxUses = 16;
+     ctx->maxInstr = 512;
+     initArena(&ctx->arena, 1 << 16);
+     initArena(&ctx->scratchAllocs, 0); //Only its counts are used
+     initOutBuf(&ctx->out, -1); //Set out.fd or out.sink before linking, otherwise it only grows
+     initOutBuf(&ctx->diags, -1);
+     ctx->imageFd = -1;
+     return ctx;
+}
 
-     initGlobalVar(argv[1]); //Init values and open file
-     passTwo(); //Pass 2
-     fclose(fptr); //Clos file
-     deallocSymbolTable(mySymTable); //Delete symbol table
-     return 0; //Done
+void destroyLinkContext(LinkContext* ctx){
+     if (ctx->cache != NULL){
+          closeCache(ctx->cache);
+     }
+     if (ctx->program != NULL){
+          deallocProgram(ctx->program); //Delete module list
+     }
+     if (ctx->symTable != NULL){
+          deallocSymbolTable(ctx->symTable); //Delete symbol table
+     }
+     if (ctx->archives != NULL){
+          closeArchives(ctx);
+     }
+     if (ctx->imageMap != NULL){ //The link failed while writing the image
+          munmap(ctx->imageMap, ctx->imageMapSize);
+     }
+     if (ctx->imageFd >= 0){
+          close(ctx->imageFd);
+     }
+     freeArena(&ctx->arena); //Delete all symbols
+     free(ctx->out.data);
+     free(ctx->diags.data);
+     free(ctx);
 }
 
-void tokenizer(const char* filename) {
-     char* temp;
-     initGlobalVar(filename);
-     while ((temp = getToken()) != NULL){
-          printf("Token: %d:%d : %s\n", linenum, lineoffset, temp);
-     }
-     printf("Final Spot in File : line=%d offset=%d\n", linenum,lineoffset);
-     fclose(fptr);
-}
-
-char* getToken(){
-     static char* linePtr; //Need to remember the head ptr
-     static int finalPosition; //Final position of the line
-     size_t n = 0; //For getline size
-     char* token; //Holds the read token
-     int result; //For getline function
-
-     token = strtok(NULL," \t\n"); //Trying to get a token
-     while (token == NULL) { //No token, then try to read a line, keep going until token is found
-          free(linePtr); //Document said free linePtr when done
-          linePtr = NULL;
-          result = getline(&linePtr, &n, fptr);
-          if (result < 1) { //EOF or Error in getline
-               lineoffset = finalPosition; //Setting offset to final position
+int linkFiles(LinkContext* ctx, InputFile* files, int count){
+     jmp_buf onFatal;
+     long long passStart, passOneEnd;
+     int k;
+
+     //Errors anywhere in the link come back here through failLink, allocation failures still exit()
+     ctx->status = LINK_OK;
+     ctx->onFatal = &onFatal;
+     if (setjmp(onFatal) == 0){
+          ctx->symTable = createSymbolTable(NULL, 256, ctx->statsOn ? &ctx->stats : NULL); //Create symbol table, its arrays grow on heap
+          ctx->program = createProgram(); //Create module list
+          ctx->report = ctx->imagePath != NULL ? &ctx->diags : &ctx->out;
+          for (k = 0; k<count; k++){
+               files[k].lex.ctx = ctx;
+          }
+          if (ctx->large && ctx->imagePath != NULL){ //Image words are classic ints
+               failLink(ctx, LINK_IO_ERROR, "Images only hold classic mode links: %s.", ctx->imagePath);
+          }
+          if (ctx->large && ctx->archiveCount > 0){ //Archived words are classic ints
+               failLink(ctx, LINK_BAD_OBJECT, "Archives only link in classic mode: %s.", ctx->archivePaths[0]);
+          }
+          if (ctx->cachePath != NULL && ctx->imagePath == NULL && !ctx->large && ctx->archiveCount == 0){ //Cached output is classic text of the input's modules, an image is always made from scratch
+               ctx->cache = openCache(ctx->cachePath);
+          }
+          passStart = ctx->statsOn ? nowNanos() : 0;
+          passOne(ctx, files, count); //Pass 1, the only pass that reads the input
+          if (ctx->archiveCount > 0){
+               pullArchiveModules(ctx);
+          }
+          passOneEnd = ctx->statsOn ? nowNanos() : 0;
+          ctx->stats.passOneNanos = passOneEnd - passStart;
+          ctx->stats.modules = ctx->program->modCount;
+          ctx->stats.instrs = ctx->program->instrCount;
+          ctx->stats.symbols = ctx->symTable->size;
+
+          passTwo(ctx); //Pass 2, works from ctx->program
+          if (ctx->statsOn){
+               flushOutBuf(&ctx->out); //Writing the output is part of pass 2
+               ctx->stats.passTwoNanos = nowNanos() - passOneEnd;
+          }
+          if (ctx->cache != NULL){
+               saveCache(ctx);
+          }
+          if (ctx->indexPath != NULL){
+               writeSymbolIndex(ctx);
+          }
+     }
+     ctx->onFatal = NULL;
+     flushOutBuf(&ctx->out); //Output up to a parse error goes out too
+     for (k = 0; k<count; k++){
+          STAT_ADD(ctx, tokens, files[k].lex.tokens); //Counted by the file's lexer, a parse error still reports them
+          STAT_ADD(ctx, lines, files[k].lex.lines);
+          if (files[k].prog != NULL){ //Parsed ahead by passOneFiles, left behind by a failed merge
+               deallocProgram(files[k].prog);
+               files[k].prog = NULL;
+          }
+     }
+     if (ctx->status == LINK_OK && ctx->out.failed){
+          ctx->status = LINK_IO_ERROR;
+          snprintf(ctx->error, sizeof(ctx->error), "Cannot write output.");
+     }
+     return ctx->status;
+}
+
+int linkBuffer(LinkContext* ctx, const char* input, size_t size, LinkSink sink, void* sinkArg){
+     InputFile f;
+     int status;
+
+     memset(&f, 0, sizeof(f));
+     initLexerBuffer(&f.lex, input, size);
+     ctx->out.fd = -1;
+     ctx->out.sink = sink;
+     ctx->out.sinkArg = sinkArg;
+     status = linkFiles(ctx, &f, 1);
+     closeLexer(&f.lex);
+     return status;
+}
+
+//Each job is a link of its own, on a context made and destroyed for it, so nothing one link
+//defines or reads is seen by another. Workers claim jobs in list order and the calling thread
+//writes them out in that order, each framed by a line "@@ bytes status name". With fd -1 the
+//jobs wrote their own output files and only the errors are printed, in list order too.
+int linkBatch(LinkContext* options, BatchJob* jobs, int count, int fd){
+     BatchQueue q;
+     pthread_t* workers;
+     struct iovec iov[2];
+     char frame[4096];
+     int threads, k, failed = 0;
+
+     pthread_mutex_init(&q.lock, NULL);
+     pthread_cond_init(&q.cond, NULL);
+     q.jobs = jobs;
+     q.count = count;
+     q.next = 0;
+     q.written = 0;
+     q.options = options;
+     threads = options->jobs < count ? options->jobs : count;
+     q.window = 4*threads; //Outputs held in memory at most
+     workers = (pthread_t*)malloc((threads > 0 ? threads : 1) * sizeof(pthread_t));
+     __atomic_add_fetch(&heapAllocs, 1, __ATOMIC_RELAXED);
+     if (workers == NULL){
+          fprintf(stderr, "linkBatch:workers Failed to allocate memory.\n");
+          exit(-1);
+     }
+     for (k = 0; k<threads; k++){
+          if (pthread_create(&workers[k], NULL, batchWorkerMain, &q) != 0){
+               fprintf(stderr, "linkBatch:workers Failed to create thread.\n");
+               exit(-1);
+          }
+     }
+     for (k = 0; k<count; k++){
+          pthread_mutex_lock(&q.lock);
+          while (!jobs[k].done){
+               pthread_cond_wait(&q.cond, &q.lock);
+          }
+          pthread_mutex_unlock(&q.lock);
+          if (fd >= 0){
+               iov[0].iov_base = frame;
+               iov[0].iov_len = snprintf(frame, sizeof(frame), "@@ %zu %d %s\n", jobs[k].out.size, jobs[k].status, jobs[k].name);
+               iov[1].iov_base = jobs[k].out.data;
+               iov[1].iov_len = jobs[k].out.size;
+               if (iov[0].iov_len >= sizeof(frame) || writevAll(fd, iov, 2) != 0){
+                    fprintf(stderr, "Cannot write output.\n");
+                    exit(-1);
+               }
+          }
+          if (jobs[k].error[0] != '\0'){
+               fprintf(stderr, "%s: %s\n", jobs[k].name, jobs[k].error);
+          }
+          failed += jobs[k].status != LINK_OK;
+          free(jobs[k].out.data);
+          jobs[k].out.data = NULL;
+          pthread_mutex_lock(&q.lock);
+          q.written = k + 1;
+          pthread_cond_broadcast(&q.cond);
+          pthread_mutex_unlock(&q.lock);
+     }
+     for (k = 0; k<threads; k++){
+          pthread_join(workers[k], NULL);
+     }
+     free(workers);
+     pthread_mutex_destroy(&q.lock);
+     pthread_cond_destroy(&q.cond);
+     return failed;
+}
+
+void* batchWorkerMain(void* arg){
+     BatchQueue* q = (BatchQueue*)arg;
+     int k;
+
+     for (;;){
+          pthread_mutex_lock(&q->lock);
+          while (q->next < q->count && q->next >= q->written + q->window){ //Writer is behind, outputs would pile up
+               pthread_cond_wait(&q->cond, &q->lock);
+          }
+          k = q->next < q->count ? q->next++ : -1;
+          pthread_mutex_unlock(&q->lock);
+          if (k == -1){
                return NULL;
           }
-          linenum += 1; //Read a line, increment line number
-          finalPosition = 1; //final position also reset
-          token = strtok(linePtr, " \t\n"); //Parse the line
+          linkBatchJob(q->options, &q->jobs[k]);
+          pthread_mutex_lock(&q->lock);
+          q->jobs[k].done = 1;
+          pthread_cond_broadcast(&q->cond);
+          pthread_mutex_unlock(&q->lock);
+     }
+}
+
+void linkBatchJob(LinkContext* options, BatchJob* job){
+     LinkContext* ctx;
+     InputFile f;
+     int fd, outFd = -1;
+
+     job->error[0] = '\0';
+     initOutBuf(&job->out, -1);
+     fd = open(job->name, O_RDONLY);
+     if (fd < 0){ //One missing input does not end the batch
+          job->status = LINK_IO_ERROR;
+          snprintf(job->error, sizeof(job->error), "Cannot open file: %s.", job->name);
+          return;
+     }
+     if (job->outPath != NULL){
+          outFd = open(job->outPath, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+          if (outFd < 0){
+               close(fd);
+               job->status = LINK_IO_ERROR;
+               snprintf(job->error, sizeof(job->error), "Cannot write file: %s.", job->outPath);
+               return;
+          }
+     }
+     ctx = createLinkContext();
+     if (options->large){
+          setLargeMode(ctx, options->machineSize, options->operandWidth);
+     }
+     ctx->archivePaths = options->archivePaths; //Each job maps the archives for itself
+     ctx->archiveCount = options->archiveCount;
+     memset(&f, 0, sizeof(f));
+     f.name = job->name;
+     initLexerFd(&f.lex, fd);
+     if (outFd >= 0){
+          ctx->out.fd = outFd;
+     } else{
+          ctx->out.sink = batchSink;
+          ctx->out.sinkArg = &job->out;
      }
+     job->status = linkFiles(ctx, &f, 1);
+     memcpy(job->error, ctx->error, sizeof(job->error));
+     closeLexer(&f.lex);
+     destroyLinkContext(ctx);
+     if (outFd >= 0 && close(outFd) != 0 && job->status == LINK_OK){
+          job->status = LINK_IO_ERROR;
+          snprintf(job->error, sizeof(job->error), "Cannot write file: %s.", job->outPath);
+     }
+}
 
-     lineoffset = token - linePtr + 1; //Current addr - head addr + 1 = current position
-     finalPosition = lineoffset + strlen(token); //Current offset + len(token) = last position,eof
-     return token;
+int batchSink(void* arg, const char* bytes, size_t n){
+     outBytes((OutBuf*)arg, bytes, n);
+     return 0;
 }
 
-void passOne() {
-     int defCount, useCount, moduleSize, i, currentBaseAddr, currentModule, totalInstr;
-     Module mod; //hold module info
+//A manifest lists one input per line, blank lines and lines starting with # are skipped, "-" reads
+//it from stdin. A directory gives every regular file in it not starting with a dot, sorted by name.
+char** readBatchList(const char* path, int* count){
+     struct stat sb;
+     struct dirent* e;
+     DIR* dir;
+     char** names = NULL;
+     char* text = NULL;
+     char* line;
+     char* end;
+     int cap = 0, fd;
+     long size = 0, textCap = 0, n;
 
-     currentBaseAddr = 0; //Base addr starts from 0
-     currentModule = 1; //Module number starts from 1
-     totalInstr = 0; //Counts total instr, <512
-     while (1){
-          //Create module
-          mod.baseAddr = currentBaseAddr;
-          mod.id = currentModule;
-
-          //Reading defList
-          defCount = readInt();
-          if (defCount > 16){ //Error checking
-               __parseerror(4);
-          } else if(defCount == -1) {
-               break; //EoF break loop
-          }
-          for (i=0; i<defCount; i++) {
-               char* symToken; //From getToken
-               Symbol* symbol; //CreateSymbol()
-               int rel; //Relative addr
-
-               symToken = readSym();
-               symbol = createSymbol(symToken,mod);
-               if ((rel = readInt()) == -1){
-                    __parseerror(0);
-               }
-               symbol->relAddr = rel; //Relative addr
-               symbol->absAddr = rel + currentBaseAddr; //Abs addr = Rel + Base
-               addSymbolToTable(mySymTable, symbol); //Add to symbol table
-          }
-
-          //Reading useList
-          useCount = readInt();
-          if (useCount > 16){ //Error checking
-               __parseerror(5);
-          } else if(useCount == -1) {
-               __parseerror(0);
-          }
-          for (i=0; i<useCount; i++){
-               readSym(); //Discarding return value
-               //Do nothing else
-          }
-
-          //Reading program text
-          moduleSize = readInt(); //Module length
-          if (moduleSize > 512) { //Error checking
-               __parseerror(6);
-          } else if (moduleSize == -1){
-               __parseerror(0);
-          }
-          totalInstr += moduleSize; //Counting total instr so far in the input
-          if (totalInstr > 512) { //Too many instr
-               __parseerror(6);
+     *count = 0;
+     if (strcmp(path, "-") != 0 && stat(path, &sb) == 0 && S_ISDIR(sb.st_mode)){
+          dir = opendir(path);
+          if (dir == NULL){
+               fprintf(stderr, "Cannot open file: %s.\n", path);
+               exit(-1);
           }
-          for (i=0; i<moduleSize; i++){
-               readIEAR(); //Discarding return value
-               if (readInt() == -1){ //Error checking
-                    __parseerror(2);
+          while ((e = readdir(dir)) != NULL){
+               if (e->d_name[0] == '.'){
+                    continue;
+               }
+               if (*count == cap){
+                    names = (char**)growArray(names, &cap, sizeof(char*), "readBatchList:names");
+               }
+               names[*count] = (char*)malloc(strlen(path) + strlen(e->d_name) + 2);
+               if (names[*count] == NULL){
+                    fprintf(stderr, "readBatchList:names Failed to allocate memory.\n");
+                    exit(-1);
                }
-               //Feels like nothing to do here for pass 1 also
+               sprintf(names[*count], "%s/%s", path, e->d_name);
+               if (stat(names[*count], &sb) != 0 || !S_ISREG(sb.st_mode)){
+                    free(names[*count]);
+                    continue;
+               }
+               *count += 1;
+          }
+          closedir(dir);
+          qsort(names, *count, sizeof(char*), compareNames);
+          return names;
+     }
+
+     fd = strcmp(path, "-") == 0 ? 0 : open(path, O_RDONLY);
+     if (fd < 0){
+          fprintf(stderr, "Cannot open file: %s.\n", path);
+          exit(-1);
+     }
+     do{ //Whole manifest, null terminated
+          if (size + 1 >= textCap){
+               textCap = textCap == 0 ? 1 << 12 : 2*textCap;
+               text = (char*)realloc(text, textCap);
+               if (text == NULL){
+                    fprintf(stderr, "readBatchList:text Failed to allocate memory.\n");
+                    exit(-1);
+               }
+          }
+          n = read(fd, text + size, textCap - 1 - size);
+          if (n < 0 && errno != EINTR){
+               fprintf(stderr, "Cannot open file: %s.\n", path);
+               exit(-1);
+          }
+          size += n > 0 ? n : 0;
+     }while (n != 0);
+     if (fd > 0){
+          close(fd);
+     }
+     text[size] = '\0';
+     for (line = text; *line != '\0'; line = end){
+          for (end = line; *end != '\0' && *end != '\n'; end++);
+          if (*end == '\n'){
+               *end++ = '\0';
+          }
+          n = strlen(line);
+          while (n > 0 && isspace((unsigned char)line[n-1])){ //Trailing blanks and a CR
+               line[--n] = '\0';
+          }
+          if (n == 0 || line[0] == '#'){
+               continue;
+          }
+          if (*count == cap){
+               names = (char**)growArray(names, &cap, sizeof(char*), "readBatchList:names");
+          }
+          names[*count] = strdup(line);
+          if (names[*count] == NULL){
+               fprintf(stderr, "readBatchList:names Failed to allocate memory.\n");
+               exit(-1);
           }
+          *count += 1;
+     }
+     free(text);
+     return names;
+}
+
+int compareNames(const void* a, const void* b){
+     return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+//Sorting a copy of the paths, equal ones end up next to each other
+const char* duplicateOutPath(BatchJob* jobs, int count){
+     const char* dup = NULL;
+     char** paths;
+     int k;
+
+     paths = (char**)malloc((count > 0 ? count : 1) * sizeof(char*));
+     if (paths == NULL){
+          fprintf(stderr, "duplicateOutPath:paths Failed to allocate memory.\n");
+          exit(-1);
+     }
+     for (k = 0; k<count; k++){
+          paths[k] = jobs[k].outPath;
+     }
+     qsort(paths, count, sizeof(char*), compareNames);
+     for (k = 1; dup == NULL && k<count; k++){
+          if (strcmp(paths[k-1], paths[k]) == 0){
+               dup = paths[k];
+          }
+     }
+     free(paths);
+     return dup;
+}
+
+//Large mode lifts the classic limits: def and use lists of any length, as many instructions as the
+//machine has addresses, and words of a one digit opcode and an operand of operandWidth digits held
+//in 64 bits. The machine size may not exceed what an operand can address. Output has the classic
+//lines with the memory map columns widened to the last address and the word width.
+int setLargeMode(LinkContext* ctx, long long machineSize, int operandWidth){
+     long long scale;
+     int i;
+
+     if (operandWidth < 1 || operandWidth > 17){ //A word of 18 digits still fits
+          return 0;
+     }
+     for (scale = 1, i = 0; i<operandWidth; i++){
+          scale *= 10;
+     }
+     if (machineSize < 1 || machineSize > scale){
+          return 0;
+     }
+     ctx->large = 1;
+     ctx->machineSize = machineSize;
+     ctx->operandWidth = operandWidth;
+     ctx->operandScale = scale;
+     ctx->maxDefs = INT_MAX;
+     ctx->maxUses = INT_MAX;
+     ctx->maxInstr = machineSize < INT_MAX ? (int)machineSize : INT_MAX; //Instructions are held in memory
+     for (ctx->addrWidth = 1, scale = 10; scale < machineSize; scale *= 10){ //Digits of machineSize-1
+          ctx->addrWidth += 1;
+     }
+     memset(ctx->illegalWord, '9', operandWidth + 1);
+     ctx->illegalWord[operandWidth + 1] = '\0';
+     return 1;
+}
+
+int convertFiles(LinkContext* ctx, InputFile* files, int count, const char* filename){
+     jmp_buf onFatal;
+     int k;
+
+     ctx->status = LINK_OK;
+     ctx->onFatal = &onFatal;
+     if (setjmp(onFatal) == 0){
+          ctx->program = createProgram();
+          for (k = 0; k<count; k++){
+               files[k].lex.ctx = ctx;
+          }
+          convertToObject(ctx, files, count, filename);
+     }
+     ctx->onFatal = NULL;
+     flushOutBuf(&ctx->out); //A parse error is reported in the output like when linking
+     return ctx->status;
+}
+
+//Ends the running link, linkFiles or convertFiles returns the status.
+//The error message is fmt with name for %s, NULL when the output already says what went wrong.
+//Only called on the thread running the link, worker threads leave errors to it.
+void failLink(LinkContext* ctx, int status, const char* fmt, const char* name){
+     ctx->status = status;
+     if (fmt != NULL){
+          snprintf(ctx->error, sizeof(ctx->error), fmt, name == NULL ? "-" : name);
+     }
+     longjmp(*ctx->onFatal, 1);
+}
+
+void tokenizer(const char* filename) {
+     Lexer lex;
+     OutBuf out;
+     const char* temp;
+     int len;
+     initLexer(&lex, filename);
+     initOutBuf(&out, 1);
+     while ((temp = getToken(&lex, &len)) != NULL){
+          outStr(&out, "Token: ");
+          outInt(&out, lex.linenum, 0);
+          outStr(&out, ":");
+          outInt(&out, lex.lineoffset, 0);
+          outStr(&out, " : ");
+          outBytes(&out, temp, len);
+          outStr(&out, "\n");
+     }
+     outStr(&out, "Final Spot in File : line=");
+     outInt(&out, lex.linenum, 0);
+     outStr(&out, " offset=");
+     outInt(&out, lex.lineoffset, 0);
+     outStr(&out, "\n");
+     flushOutBuf(&out);
+     free(out.data);
+     closeLexer(&lex);
+}
+
+const char* getToken(Lexer* lx, int* len){
+     long start; //Start of the token in buf
+     long pos; //Scan position, kept out of lx until the token is found
+     const char* nl;
+     unsigned long long bits;
+
+     if (lx->stream != NULL){ //Tokenized by a --pipeline lexer stage
+          return streamToken(lx, len);
+     }
+     pos = lx->pos;
+     while (1){
+          if (lx->inLine){ //Skipping blanks, tokens end at " \t\n" like strtok did
+               while (1){
+                    if (pos >= lx->blockStart && pos < lx->blockEnd
+                         && (bits = ~lx->blankBits >> (pos - lx->blockStart)) != 0 && pos + __builtin_ctzll(bits) < lx->blockEnd){
+                         pos += __builtin_ctzll(bits); //Fast path, the blanks end in this block
+                         break;
+                    }
+                    pos = scanBytes(lx, pos, 0);
+                    if (pos < lx->size){
+                         break;
+                    }
+                    lx->pos = pos;
+                    if (refillLexer(lx, pos) == 0){
+                         pos = lx->pos;
+                         break;
+                    }
+                    pos = lx->pos;
+               }
+               if (pos < lx->size && lx->buf[pos] != '\n' && lx->buf[pos] != '\0'){
+                    break; //Found a token
+               }
+               //Rest of the line has no tokens, a null char also hides the rest of the line
+               while (1){
+                    if (pos < lx->size && lx->buf[pos] == '\n'){ //Usual case, the line ends right after its last token
+                         pos += 1;
+                         break;
+                    }
+                    nl = memchr(lx->buf + pos, '\n', lx->size - pos);
+                    if (nl != NULL){
+                         pos = nl - lx->buf + 1;
+                         break;
+                    }
+                    lx->pos = lx->size;
+                    if (refillLexer(lx, lx->pos) == 0){
+                         pos = lx->pos;
+                         break;
+                    }
+                    pos = lx->pos;
+               }
+               lx->inLine = 0;
+          }
+          //No token, then try to read a line
+          if (pos == lx->size){
+               lx->pos = pos;
+               if (refillLexer(lx, pos) == 0){ //EoF
+                    lx->lineoffset = lx->finalPosition; //Setting offset to final position
+                    return NULL;
+               }
+               pos = lx->pos;
+          }
+          lx->linenum += 1; //Read a line, increment line number
+          LEX_COUNT(lx, lines);
+          lx->finalPosition = 1; //final position also reset
+          lx->lineStart = lx->base + pos;
+          lx->inLine = 1;
+     }
+
+     start = pos;
+     while (1){
+          if (pos >= lx->blockStart && pos < lx->blockEnd
+               && (bits = lx->delimBits >> (pos - lx->blockStart)) != 0 && pos + __builtin_ctzll(bits) < lx->blockEnd){
+               pos += __builtin_ctzll(bits); //Fast path, the token ends in this block
+               break;
+          }
+          pos = scanBytes(lx, pos, 1);
+          if (pos < lx->size){
+               break;
+          } else{
+               long kept = pos - start;
+               int more;
+               lx->pos = pos;
+               more = refillLexer(lx, start);
+               pos = lx->pos;
+               start = pos - kept; //Buffer may have moved, token bytes are now at the front
+               if (more == 0){
+                    break;
+               }
+          }
+     }
+     lx->pos = pos;
+     *len = pos - start;
+     lx->lineoffset = lx->base + start - lx->lineStart + 1; //Current addr - line head addr + 1 = current position
+     lx->finalPosition = lx->lineoffset + *len; //Current offset + len(token) = last position,eof
+     LEX_COUNT(lx, tokens);
+     return lx->buf + start;
+}
+
+//Returns the position of the first delimiter (' ', '\t', '\n', '\0') when delims is set, otherwise
+//of the first byte that is not a blank, at or after pos, lx->size when there is none in buf.
+//Tokens and blanks are mostly 1 to 4 bytes, so bytes are classified 64 at a time into the lexer's
+//block masks and each call is a shift and a count of trailing zeros until the block runs out.
+long scanBytes(Lexer* lx, long pos, int delims){
+     unsigned long long bits;
+     while (pos < lx->size){
+          if (pos < lx->blockStart || pos >= lx->blockEnd){
+               classifyBlock(lx, pos);
+          }
+          bits = (delims ? lx->delimBits : ~lx->blankBits) >> (pos - lx->blockStart);
+          if (bits != 0){
+               pos += __builtin_ctzll(bits);
+               return pos < lx->blockEnd ? pos : lx->blockEnd; //Bits past a short block are not bytes
+          }
+          pos = lx->blockEnd;
+     }
+     return lx->size;
+}
+
+void classifyBlock(Lexer* lx, long pos){
+     unsigned long long bit;
+     long i, n;
+     n = lx->size - pos < 64 ? lx->size - pos : 64;
+     lx->blockStart = pos;
+     lx->blockEnd = pos + n;
+     if (n == 64){
+          classifyBytes(lx->buf + pos, &lx->delimBits, &lx->blankBits);
+          return;
+     }
+     //Short block at the end of buf, loads would read past it
+     lx->delimBits = 0;
+     lx->blankBits = 0;
+     for (i = 0, bit = 1; i<n; i++, bit <<= 1){
+          char c = lx->buf[pos + i];
+          if (c == ' ' || c == '\t'){
+               lx->blankBits |= bit;
+               lx->delimBits |= bit;
+          } else if (c == '\n' || c == '\0'){
+               lx->delimBits |= bit;
+          }
+     }
+}
+
+__attribute__((constructor)) void selectScanners(){
+     classifyBytes = classifyScalar;
+#ifdef SIMD_SCAN
+     classifyBytes = classifySse2; //Every x86-64 has SSE2
+     __builtin_cpu_init();
+     if (__builtin_cpu_supports("avx2")){
+          classifyBytes = classifyAvx2;
+     }
+#endif
+}
+
+void classifyScalar(const char* p, unsigned long long* delims, unsigned long long* blanks){
+     unsigned long long bit;
+     int i;
+     *delims = 0;
+     *blanks = 0;
+     for (i = 0, bit = 1; i<64; i++, bit <<= 1){
+          if (p[i] == ' ' || p[i] == '\t'){
+               *blanks |= bit;
+               *delims |= bit;
+          } else if (p[i] == '\n' || p[i] == '\0'){
+               *delims |= bit;
+          }
+     }
+}
+
+#ifdef SIMD_SCAN
+void classifySse2(const char* p, unsigned long long* delims, unsigned long long* blanks){
+     __m128i v, blank, end;
+     int i;
+     *delims = 0;
+     *blanks = 0;
+     for (i = 0; i<64; i += 16){
+          v = _mm_loadu_si128((const __m128i*)(p + i));
+          blank = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+          end = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+          *blanks |= (unsigned long long)(unsigned int)_mm_movemask_epi8(blank) << i;
+          *delims |= (unsigned long long)(unsigned int)_mm_movemask_epi8(_mm_or_si128(blank, end)) << i;
+     }
+}
+
+__attribute__((target("avx2"))) void classifyAvx2(const char* p, unsigned long long* delims, unsigned long long* blanks){
+     __m256i v, blank, end;
+     int i;
+     *delims = 0;
+     *blanks = 0;
+     for (i = 0; i<64; i += 32){
+          v = _mm256_loadu_si256((const __m256i*)(p + i));
+          blank = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+          end = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+          *blanks |= (unsigned long long)(unsigned int)_mm256_movemask_epi8(blank) << i;
+          *delims |= (unsigned long long)(unsigned int)_mm256_movemask_epi8(_mm256_or_si256(blank, end)) << i;
+     }
+}
+#endif
+
+void passOne(LinkContext* ctx, InputFile* files, int count) {
+     Lexer* lex = &files[0].lex;
+     PassOne st;
+     int k;
+
+     st.baseAddr = 0; //Base addr starts from 0
+     st.moduleId = 1; //Module number starts from 1
+     st.totalInstr = 0; //Counts total instr, <512
+     st.outIndex = 0;
+     for (k = 0; k<count && ctx->cache != NULL; k++){
+          if (isObjectInput(&files[k].lex)){ //No module text to hash, linked without the cache
+               closeCache(ctx->cache);
+               ctx->cache = NULL;
+          }
+     }
+     if (ctx->cache != NULL){
+          for (k = 0; k<count; k++){
+               passOneIncremental(ctx, &files[k].lex, &st);
+          }
+          return;
+     }
+     if (count > 1){
+          passOneFiles(ctx, files, count);
+          return;
+     }
+     if (ctx->pipeline && lex->cap == 0 && !lex->borrowed){ //Mapped file, the reader stage reads it instead
+          streamLexer(lex);
+     }
+     if (isObjectInput(lex)){
+          passOneObject(ctx, lex, files[0].name);
+          return;
+     }
+     if (ctx->pipeline && lex->cap > 0){
+          passOnePipelined(ctx, lex, &st);
+          return;
+     }
+     if (ctx->jobs > 1 && lex->cap == 0 && lex->size >= PARALLEL_PASS_ONE_MIN){ //Needs the whole input in memory
+          passOneParallel(ctx, lex);
+          return;
+     }
+     passOneRange(ctx, lex, &st, LONG_MAX);
+}
+
+void passOneFiles(LinkContext* ctx, InputFile* files, int count) {
+     FileQueue q;
+     pthread_t* threads;
+     InputFile* f;
+     ModuleIR* m;
+     PassOne st;
+     int i, j, k, total, jobs, defined;
+
+     //Every file is parsed whole ahead of the merge, on up to jobs threads
+     q.files = files;
+     q.count = count;
+     q.next = 0;
+     jobs = ctx->jobs;
+     if (jobs > count){
+          jobs = count;
+     }
+     if (jobs == 1){
+          parseFileMain(&q);
+     } else{
+          threads = (pthread_t*)malloc(jobs * sizeof(pthread_t));
+          __atomic_add_fetch(&heapAllocs, 1, __ATOMIC_RELAXED);
+          if (threads == NULL){
+               fprintf(stderr, "passOneFiles:threads Failed to allocate memory.\n");
+               exit(-1);
+          }
+          for (i = 0; i<jobs; i++){
+               if (pthread_create(&threads[i], NULL, parseFileMain, &q) != 0){
+                    fprintf(stderr, "passOneFiles: Failed to create thread.\n");
+                    exit(-1);
+               }
+          }
+          for (i = 0; i<jobs; i++){
+               pthread_join(threads[i], NULL);
+          }
+          free(threads);
+     }
+
+     //Merging in command line order, numbering and bases run on across files.
+     //A file with a parse error, or one that goes over the instr limit here, is parsed again
+     //serially from its start so the error comes out where it is.
+     st.baseAddr = 0;
+     st.moduleId = 1;
+     st.totalInstr = 0;
+     st.outIndex = 0;
+     defined = 0; //Modules before this one have their defs in the symbol table
+     for (k = 0; k<count; k++){
+          f = &files[k];
+          defineModules(ctx, defined, ctx->program->modCount); //Text files are defined in batches, up to here
+          defined = ctx->program->modCount;
+          if (f->object){
+               if (!f->ok){
+                    failLink(ctx, LINK_BAD_OBJECT, "Invalid object file: %s.", f->name);
+               }
+               for (j = 0; j<f->prog->modCount; j++){
+                    m = &f->prog->modules[j];
+                    checkObjectModule(ctx, &st, m, f->name);
+                    copyModuleToProgram(ctx->program, f->prog, m);
+                    defineModule(ctx, &st, ctx->program, &ctx->program->modules[ctx->program->modCount-1]);
+               }
+               continue;
+          }
+          total = st.totalInstr;
+          for (j = 0; f->ok && j<f->prog->modCount; j++){
+               if (f->prog->modules[j].length > instrBudget(ctx, total)){
+                    f->ok = 0;
+               }
+               total += f->prog->modules[j].length;
+          }
+          if (!f->ok){
+               f->lex = f->start;
+               passOneRange(ctx, &f->lex, &st, LONG_MAX);
+               defined = ctx->program->modCount;
+               continue;
+          }
+          for (j = 0; j<f->prog->modCount; j++){
+               copyModuleToProgram(ctx->program, f->prog, &f->prog->modules[j]);
+               numberModule(&st, &ctx->program->modules[ctx->program->modCount-1]);
+          }
+     }
+     defineModules(ctx, defined, ctx->program->modCount);
+     for (k = 0; k<count; k++){
+          deallocProgram(files[k].prog);
+          files[k].prog = NULL;
+     }
+}
+
+void* parseFileMain(void* arg) {
+     FileQueue* q = (FileQueue*)arg;
+     int k;
+     while ((k = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < q->count){
+          parseInputFile(&q->files[k]);
+     }
+     return NULL;
+}
+
+void parseInputFile(InputFile* f) {
+     jmp_buf onError;
+     long start;
+
+     f->prog = createProgram();
+     f->ok = 0;
+     f->object = isObjectInput(&f->lex);
+     while (refillLexer(&f->lex, 0)); //Piped input, reading all of it so it can be parsed again
+     if (f->object){
+          f->ok = mapObject(f->lex.buf, f->lex.size, f->prog);
+          return;
+     }
+     f->start = f->lex;
+     f->lex.onError = &onError;
+     if (setjmp(onError) != 0){
+          return; //The merge parses it again for the error message
+     }
+     while (parseModule(&f->lex, f->prog, INT_MAX, LONG_MAX, &start) == 1); //The instr limit is checked in the merge
+     f->lex.onError = NULL;
+     f->ok = 1;
+}
+
+//512 - total in classic mode, as int arithmetic always did. Large mode totals can be near INT_MAX
+//and the budget is clamped instead
+int instrBudget(LinkContext* ctx, int total) {
+     long long budget;
+     if (!ctx->large){
+          return ctx->maxInstr - total;
+     }
+     budget = (long long)ctx->maxInstr - total;
+     return budget > INT_MAX ? INT_MAX : (int)budget;
+}
+
+long passOneRange(LinkContext* ctx, Lexer* lex, PassOne* st, long stop) {
+     int r;
+     long start;
+     while ((r = parseModule(lex, ctx->program, instrBudget(ctx, st->totalInstr), stop, &start)) == 1){
+          defineModule(ctx, st, ctx->program, &ctx->program->modules[ctx->program->modCount-1]);
+     }
+     return r == 0 ? LONG_MAX : start; //EoF or first module at or after stop
+}
+
+//Parses a module into p, checks syntax and limits, the instr budget is what is left of the 512 total
+//Returns 1 when a module was parsed, 0 on EoF before a module starts
+//Returns 2 without consuming anything when the module would start at or after stop
+//start is set to the position of the module's first token
+//In large mode the limits are the link's, words are 64 bit, and counts and addresses too big for an
+//int saturate instead of wrapping, a def that far is past its module anyway
+int parseModule(Lexer* lex, Program* p, int instrBudget, long stop, long* start) {
+     LinkContext* ctx = lex->ctx; //Limits of the link
+     int defCount, useCount, moduleSize, i, len;
+     const char* token;
+     Module mod = {0, 0}; //Numbered by defineModule
+     ModuleIR* modIR; //Module record kept for pass 2
+
+     //Reading defList
+     token = getToken(lex, &len);
+     if (token == NULL){
+          return 0; //EoF break loop
+     }
+     *start = lex->base + (token - lex->buf);
+     if (*start >= stop){ //Leaving the token for whoever parses from stop
+          lex->pos = token - lex->buf;
+          return 2;
+     }
+     defCount = ctx->large ? saturateInt(parseLongToken(lex, token, len)) : parseIntToken(lex, token, len);
+     if (defCount > ctx->maxDefs){ //Error checking
+          __parseerror(lex,4);
+     }
+     modIR = addModuleToProgram(p, mod);
+     for (i=0; i<defCount; i++) {
+          const char* symToken; //From getToken, a view into the input
+          int symLen; //Length of symToken
+          int rel; //Relative addr
+
+          symToken = readSym(lex, &symLen);
+          addDefToProgram(p, modIR, symToken, symLen, 0); //Copied now, reading rel may refill the buffer under symToken
+          if ((rel = ctx->large ? saturateInt(readLong(lex)) : readInt(lex)) == -1){
+               __parseerror(lex,0);
+          }
+          p->defs[p->defCount-1].relAddr = rel;
+     }
+
+     //Reading useList
+     useCount = ctx->large ? saturateInt(readLong(lex)) : readInt(lex);
+     if (useCount > ctx->maxUses){ //Error checking
+          __parseerror(lex,5);
+     } else if(useCount == -1) {
+          __parseerror(lex,0);
+     }
+     for (i=0; i<useCount; i++){
+          const char* symToken;
+          int symLen;
+          symToken = readSym(lex, &symLen);
+          addUseToProgram(p, modIR, symToken, symLen); //Resolved in pass 2
+     }
+
+     //Reading program text
+     moduleSize = ctx->large ? saturateInt(readLong(lex)) : readInt(lex); //Module length
+     if (moduleSize > ctx->maxInstr) { //Error checking
+          __parseerror(lex,6);
+     } else if (moduleSize == -1){
+          __parseerror(lex,0);
+     }
+     if (moduleSize > instrBudget) { //Too many instr so far in the input
+          __parseerror(lex,6);
+     }
+     modIR->length = moduleSize;
+     if (ctx->large){
+          for (i=0; i<moduleSize; i++){
+               char addressMode;
+               long op;
+               addressMode = readIEAR(lex);
+               if ((op = readLong(lex)) == -1){
+                    __parseerror(lex,2);
+               }
+               addWideInstrToProgram(p, modIR, addressMode, op);
+          }
+          return 1;
+     }
+     for (i=0; i<moduleSize; i++){
+          char addressMode;
+          int op;
+          addressMode = readIEAR(lex);
+          if ((op = readInt(lex)) == -1){ //Error checking
+               __parseerror(lex,2);
+          }
+          addInstrToProgram(p, modIR, addressMode, op); //Relocated in pass 2
+     }
+     return 1;
+}
+
+void defineModule(LinkContext* ctx, PassOne* st, Program* p, ModuleIR* modIR) {
+     numberModule(st, modIR);
+     addModuleDefs(ctx, p, modIR);
+}
+
+void numberModule(PassOne* st, ModuleIR* modIR) {
+     modIR->mod.baseAddr = st->baseAddr;
+     modIR->mod.id = st->moduleId;
+     modIR->mod.outIndex = st->outIndex;
+     st->totalInstr += modIR->length; //Counting total instr so far in the input
+     st->outIndex += modIR->instrCount; //Rows are printed back to back whatever the lengths
+     st->moduleId += 1; //Updating module number
+     st->baseAddr += modIR->length; //Update base addr for next module
+}
+
+void addModuleDefs(LinkContext* ctx, Program* p, ModuleIR* modIR) {
+     int i;
+     long long t; //rule 5 start for --stats
+     Def* def;
+
+     for (i=0; i<modIR->defCount; i++){
+          def = &p->defs[modIR->defStart + i];
+          addSymbolToTable(ctx->symTable, p->strings + def->sym, modIR->mod, def->relAddr); //Abs addr = Rel + Base
+          STAT_ADD(ctx, symbolAllocs, 1);
+     }
+     t = ctx->statsOn ? nowNanos() : 0;
+     rule5Violation(ctx, modIR->defCount, modIR->length); //Check for rule 5 violations
+     STAT_TIME(ctx, rule5Nanos, t);
+}
+
+//Modules parsed on threads are numbered as they are merged and defined here in batches.
+//Big batches are hashed and checked for duplicates on ctx->jobs threads through a ConcurrentTable,
+//then this thread appends the first definition of every new name in module order and replays the
+//rule 2 and rule 5 checks, so the table and the warnings are what defineModule gives.
+void defineModules(LinkContext* ctx, int from, int to) {
+     SymbolTable* st = ctx->symTable;
+     ConcurrentTable* table;
+     DefineWorker* workers;
+     ModuleIR* modIR;
+     const char* name;
+     long long t; //rule 5 start for --stats
+     int m, i, d, b, first, count, jobs;
+
+     if (from >= to){
+          return;
+     }
+     first = ctx->program->modules[from].defStart;
+     count = ctx->program->modules[to-1].defStart + ctx->program->modules[to-1].defCount - first;
+     if (ctx->jobs == 1 || count < CONCURRENT_DEFINE_MIN){
+          for (m = from; m<to; m++){
+               addModuleDefs(ctx, ctx->program, &ctx->program->modules[m]);
+          }
+          return;
+     }
+     table = createConcurrentTable(ctx->program, first, count);
+     jobs = ctx->jobs;
+     workers = (DefineWorker*)malloc(jobs * sizeof(DefineWorker));
+     __atomic_add_fetch(&heapAllocs, 1, __ATOMIC_RELAXED);
+     if (workers == NULL){
+          fprintf(stderr, "defineModules:workers Failed to allocate memory.\n");
+          exit(-1);
+     }
+     for (i = 0; i<jobs; i++){
+          workers[i].table = table;
+          workers[i].symTable = st;
+          workers[i].begin = first + (long long)count * i / jobs;
+          workers[i].end = first + (long long)count * (i + 1) / jobs;
+          if (pthread_create(&workers[i].tid, NULL, defineWorkerMain, &workers[i]) != 0){
+               fprintf(stderr, "defineModules: Failed to create thread.\n");
+               exit(-1);
+          }
+     }
+     for (i = 0; i<jobs; i++){
+          pthread_join(workers[i].tid, NULL);
+     }
+     free(workers);
+
+     for (m = from; m<to; m++){
+          modIR = &ctx->program->modules[m];
+          for (i=0; i<modIR->defCount; i++){
+               d = modIR->defStart + i;
+               b = d - first;
+               name = ctx->program->strings + ctx->program->defs[d].sym;
+               if (table->owner[b] == -1 && !table->dup[b]){ //First definition of a new name
+                    table->owner[b] = appendSymbol(st, name, table->hashes[b], modIR->mod, ctx->program->defs[d].relAddr);
+               } else if (table->owner[b] == -1){ //Defined again in the batch, the lowest def is in the table by now
+                    BIT_SET(st->definedAlready, table->owner[concurrentFind(table, name, table->hashes[b]) - first]);
+               } else{ //Defined before the batch
+                    BIT_SET(st->definedAlready, table->owner[b]);
+               }
+          }
+          STAT_ADD(ctx, symbolAllocs, modIR->defCount);
+          t = ctx->statsOn ? nowNanos() : 0;
+          rule5Violation(ctx, modIR->defCount, modIR->length); //Check for rule 5 violations
+          STAT_TIME(ctx, rule5Nanos, t);
+     }
+     deallocConcurrentTable(table);
+}
+
+void passOneParallel(LinkContext* ctx, Lexer* lex) {
+     Chunk* chunks;
+     PassOne st;
+     Lexer first;
+     jmp_buf onFatal; //Frees the chunks when the merge fails the link
+     jmp_buf* outer;
+     const char* token;
+     long cur, chunkSize, b;
+     int nChunks, k, j, len, defined;
+
+     //Splitting the input into line aligned chunks, a few per thread to even out the work
+     nChunks = ctx->jobs * 4;
+     chunkSize = lex->size / nChunks + 1;
+     chunks = (Chunk*)calloc(nChunks, sizeof(Chunk));
+     if (chunks == NULL){
+          fprintf(stderr, "passOneParallel:chunks Failed to allocate memory.\n");
+          exit(-1);
+     }
+     b = 0;
+     for (k = 0; k<nChunks; k++){
+          chunks[k].src = lex;
+          chunks[k].begin = b;
+          if (k == nChunks-1 || b + chunkSize >= lex->size){
+               b = lex->size;
+          } else{
+               const char* nl = memchr(lex->buf + b + chunkSize, '\n', lex->size - b - chunkSize);
+               b = (nl == NULL) ? lex->size : nl - lex->buf + 1;
+          }
+          chunks[k].end = b;
+          chunks[k].maxTries = 3 + 2L*ctx->maxDefs + ctx->maxUses + 2L*ctx->maxInstr; //Counts, defs, uses, instrs
+          chunks[k].prog = createProgram();
+          if (pthread_create(&chunks[k].tid, NULL, parseChunk, &chunks[k]) != 0){
+               fprintf(stderr, "passOneParallel: Failed to create thread.\n");
+               exit(-1);
+          }
+     }
+     for (k = 0; k<nChunks; k++){
+          pthread_join(chunks[k].tid, NULL);
+     }
+
+     //Merging in input order, a chunk is only trusted when its speculative start is where the
+     //previous chunk really ended, since parsing from a position always gives the same modules.
+     //Anything else is parsed again serially from the trusted position, with the real errors.
+     outer = ctx->onFatal;
+     ctx->onFatal = &onFatal;
+     if (setjmp(onFatal) == 0){
+          st.baseAddr = 0;
+          st.moduleId = 1;
+          st.totalInstr = 0;
+          st.outIndex = 0;
+          first = *lex;
+          token = getToken(&first, &len);
+          cur = (token == NULL) ? LONG_MAX : token - lex->buf; //First module starts at the first token
+          defined = 0; //Modules before this one have their defs in the symbol table
+          for (k = 0; k<nChunks; k++){
+               if (cur >= chunks[k].end){ //Previous chunk's last module covered this chunk
+                    continue;
+               }
+               if (chunks[k].first == cur){
+                    for (j = 0; j<chunks[k].prog->modCount; j++){
+                         ModuleIR* m = &chunks[k].prog->modules[j];
+                         if (m->length > instrBudget(ctx, st.totalInstr)){ //Reparse so the error has its position
+                              cur = chunks[k].starts[j];
+                              break;
+                         }
+                         copyModuleToProgram(ctx->program, chunks[k].prog, m);
+                         numberModule(&st, &ctx->program->modules[ctx->program->modCount-1]); //Defined in a batch
+                    }
+                    if (j == chunks[k].prog->modCount){
+                         cur = chunks[k].next;
+                         continue;
+                    }
+               }
+               defineModules(ctx, defined, ctx->program->modCount); //Warnings before the reparse's output
+               positionLexer(lex, chunks, k, cur);
+               cur = passOneRange(ctx, lex, &st, chunks[k].end);
+               defined = ctx->program->modCount;
+          }
+          defineModules(ctx, defined, ctx->program->modCount);
+     }
+     ctx->onFatal = outer;
+     for (k = 0; k<nChunks; k++){
+          lex->tokens += chunks[k].tokens; //Reported with the input's own, see linkFiles
+          lex->lines += chunks[k].lines;
+          deallocProgram(chunks[k].prog);
+          free(chunks[k].starts);
+     }
+     free(chunks);
+     if (ctx->status != LINK_OK){
+          longjmp(*outer, 1);
+     }
+}
+
+void* parseChunk(void* arg) {
+     Chunk* c = (Chunk*)arg;
+     Lexer cursor, spec;
+     jmp_buf onError;
+     const char* token;
+     const char* p;
+     long t, start, tries;
+     int len, r;
+
+     //Counting lines while the data is hot, the merge needs them only on the slow path
+     for (p = c->src->buf + c->begin; (p = memchr(p, '\n', c->src->buf + c->end - p)) != NULL; p++){
+          c->newlines += 1;
+     }
+     c->first = -1;
+     cursor = *c->src;
+     cursor.tokens = 0;
+     cursor.lines = 0;
+     cursor.pos = c->begin;
+     cursor.inLine = 0; //begin is a line start, line numbers are relative to it
+     cursor.linenum = 0;
+     cursor.onError = &onError;
+     //Trying every token as the first token of a module until one parses up to the chunk end.
+     //In classic mode modules are at most 1+32+1+16+1+1024 tokens long, so a real start is never far
+     //away. Large mode has no such bound, the tries end with the chunk.
+     for (tries = 0; tries < c->maxTries; tries++){
+          token = getToken(&cursor, &len);
+          if (token == NULL || (t = token - cursor.buf) >= c->end){
+               break; //No module starts in this chunk
+          }
+          spec = cursor;
+          spec.pos = t; //Parsing again from this token
+          c->prog->modCount = 0;
+          c->prog->defCount = 0;
+          c->prog->useCount = 0;
+          c->prog->instrCount = 0;
+          c->prog->strSize = 0;
+          if (setjmp(onError) != 0){
+               continue; //Parse error, not a module start
+          }
+          while ((r = parseModule(&spec, c->prog, INT_MAX, c->end, &start)) == 1){
+               if (c->prog->modCount > c->startCap){
+                    c->starts = growArray(c->starts, &c->startCap, sizeof(long), "parseChunk:starts");
+               }
+               c->starts[c->prog->modCount-1] = start;
+          }
+          c->first = t;
+          c->next = (r == 0) ? LONG_MAX : start;
+          c->tokens = spec.tokens; //Started from the cursor's counts
+          c->lines = spec.lines;
+          return NULL;
+     }
+     c->tokens = cursor.tokens;
+     c->lines = cursor.lines;
+     return NULL;
+}
+
+void positionLexer(Lexer* lx, Chunk* chunks, int k, long pos) {
+     const char* p;
+     long line, lineStart;
+     int i;
+
+     //pos is in or after chunk k, lines before it are counted from the chunk totals
+     while (k > 0 && chunks[k].begin > pos){
+          k -= 1;
+     }
+     line = 1;
+     for (i = 0; i<k; i++){
+          line += chunks[i].newlines;
+     }
+     lineStart = chunks[k].begin;
+     for (p = lx->buf + chunks[k].begin; (p = memchr(p, '\n', lx->buf + pos - p)) != NULL; p++){
+          line += 1;
+          lineStart = p - lx->buf + 1;
+     }
+     lx->pos = pos;
+     lx->lineStart = lineStart;
+     lx->linenum = line;
+     lx->inLine = 1; //pos is a token on this line, it sets the offsets when read
+}
+
+//Pass 1 over a read buffer input as three stages on their own threads: the reader stage read()s
+//big blocks into the raw ring, the lexer stage runs getToken over them and writes every token with
+//its line and offset into the token ring, and this thread parses and defines modules from that.
+//Waiting on the disk or a slow pipe, tokenizing and the checks of pass 1 overlap, and the output,
+//parse errors included, is the same as a serial pass. A failed link stops the stages before it returns.
+void passOnePipelined(LinkContext* ctx, Lexer* lex, PassOne* st) {
+     Pipeline pl;
+     Lexer stream; //Pass 1's lexer, reads the token ring
+     jmp_buf onFatal; //Stops the stages when pass 1 fails the link
+     jmp_buf* outer;
+     TokenRecord rec;
+     char* copy;
+     long at;
+
+     pl.input = lex;
+     initRing(&pl.raw, RING_SIZE);
+     initRing(&pl.tokens, RING_SIZE);
+     lex->source = &pl;
+     pl.reading = !lex->eof; //Piped input may be read whole already by the object magic check
+     if (!pl.reading){
+          ringEnd(&pl.raw, &pl.raw.closed);
+     } else if (pthread_create(&pl.reader, NULL, readerStageMain, &pl) != 0){
+          fprintf(stderr, "passOnePipelined: Failed to create thread.\n");
+          exit(-1);
+     }
+     if (pthread_create(&pl.lexer, NULL, lexerStageMain, &pl) != 0){
+          fprintf(stderr, "passOnePipelined: Failed to create thread.\n");
+          exit(-1);
+     }
+     memset(&stream, 0, sizeof(Lexer));
+     stream.fd = -1;
+     stream.buf = pl.tokens.data; //Tokens are views into the ring
+     stream.borrowed = 1;
+     stream.name = lex->name;
+     stream.ctx = lex->ctx;
+     stream.stream = &pl;
+
+     outer = ctx->onFatal;
+     ctx->onFatal = &onFatal;
+     if (setjmp(onFatal) == 0){
+          passOneRange(ctx, &stream, st, LONG_MAX);
+     }
+     ctx->onFatal = outer;
+     if (ctx->status != LINK_OK){ //The stages may be waiting on a full ring or blocked reading
+          ringEnd(&pl.tokens, &pl.tokens.abandoned);
+          ringEnd(&pl.raw, &pl.raw.abandoned);
+          if (pl.reading){
+               pthread_cancel(pl.reader); //Only cancellable in read(), see readerStageMain
+          }
+     }
+     if (pl.reading){
+          pthread_join(pl.reader, NULL);
+     }
+     pthread_join(pl.lexer, NULL);
+     free(stream.spilled);
+     for (at = pl.tokens.readAt; at < pl.tokens.writeAt; at += recordSize(&rec)){ //Spilled tokens pass 1 did not get to
+          memcpy(&rec, pl.tokens.data + (at & (pl.tokens.cap - 1)), sizeof(rec));
+          if (rec.len == TOKEN_WRAP){
+               rec.len = (int)(pl.tokens.cap - (at & (pl.tokens.cap - 1)) - sizeof(rec)); //Padding is a record of the rest of the ring
+               rec.spilled = 0;
+          } else if (rec.spilled){
+               memcpy(&copy, pl.tokens.data + (at & (pl.tokens.cap - 1)) + sizeof(rec), sizeof(copy));
+               free(copy);
+          }
+     }
+     lex->source = NULL;
+     freeRing(&pl.raw);
+     freeRing(&pl.tokens);
+     if (ctx->status != LINK_OK){
+          longjmp(*outer, 1);
+     }
+}
+
+void* readerStageMain(void* arg) {
+     Pipeline* pl = (Pipeline*)arg;
+     ByteRing* r = &pl->raw;
+     long space, at, n;
+     int old;
+
+     //A failed link cancels the reader, which may be blocked on a pipe that stays open,
+     //the ring's lock is never held in read() so it is the only place cancelling is allowed
+     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+     while ((space = ringSpace(r, 1)) > 0){
+          at = r->writeAt & (r->cap - 1);
+          n = space < r->cap - at ? space : r->cap - at; //Up to the end of the ring
+          n = n < READ_BLOCK ? n : READ_BLOCK;
+          pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old);
+          do{
+               n = read(pl->input->fd, r->data + at, n);
+          } while (n < 0 && errno == EINTR);
+          pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+          if (n <= 0){ //EoF or Error in read, like refillLexer
+               break;
+          }
+          r->writeAt += n;
+          ringPublish(r, &r->tail, r->writeAt);
+     }
+     ringPublish(r, &r->tail, r->writeAt);
+     ringEnd(r, &r->closed);
+     return NULL;
+}
+
+void* lexerStageMain(void* arg) {
+     Pipeline* pl = (Pipeline*)arg;
+     const char* token;
+     int len;
+
+     while ((token = getToken(pl->input, &len)) != NULL){ //Refills through pipelineRead
+          if (!pushToken(pl, token, len)){
+               return NULL; //Pass 1 failed the link
+          }
+     }
+     if (pushToken(pl, NULL, TOKEN_EOF)){ //Line and offset of EoF for parse errors there
+          ringPublish(&pl->tokens, &pl->tokens.tail, pl->tokens.writeAt);
+          ringEnd(&pl->tokens, &pl->tokens.closed);
+     }
+     return NULL;
+}
+
+long pipelineRead(Pipeline* pl, char* dst, long n) {
+     ByteRing* r = &pl->raw;
+     long avail, at;
+
+     if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->readAt){ //About to wait, pass 1 gets the tokens so far first
+          ringPublish(&pl->tokens, &pl->tokens.tail, pl->tokens.writeAt);
+     }
+     avail = ringData(r);
+     if (avail == 0){
+          return 0;
+     }
+     at = r->readAt & (r->cap - 1);
+     n = n < avail ? n : avail;
+     n = n < r->cap - at ? n : r->cap - at;
+     memcpy(dst, r->data + at, n);
+     r->readAt += n;
+     if (r->readAt - __atomic_load_n(&r->head, __ATOMIC_RELAXED) >= r->cap / 4){
+          ringPublish(r, &r->head, r->readAt);
+     }
+     return n;
+}
+
+//Token bytes are copied into the ring, so the lexer stage's buffer can move on. Records never
+//wrap, the end of the ring is padded with a TOKEN_WRAP record when the next one does not fit.
+//Tokens bigger than a quarter of the ring are spilled into a malloc'd copy, pass 1 frees it.
+int pushToken(Pipeline* pl, const char* token, int len) {
+     ByteRing* r = &pl->tokens;
+     TokenRecord rec;
+     long size, at;
+     char* copy;
+
+     rec.len = len;
+     rec.linenum = pl->input->linenum;
+     rec.lineoffset = pl->input->lineoffset;
+     rec.spilled = len > r->cap / 4;
+     size = recordSize(&rec);
+     at = r->writeAt & (r->cap - 1);
+     if (r->cap - at < size){
+          if (ringSpace(r, r->cap - at) == 0){
+               return 0;
+          }
+          ((TokenRecord*)(r->data + at))->len = TOKEN_WRAP;
+          r->writeAt += r->cap - at;
+          at = 0;
+     }
+     if (ringSpace(r, size) == 0){
+          return 0;
+     }
+     memcpy(r->data + at, &rec, sizeof(rec));
+     if (rec.spilled){
+          copy = (char*)malloc(len);
+          __atomic_add_fetch(&heapAllocs, 1, __ATOMIC_RELAXED);
+          if (copy == NULL){
+               fprintf(stderr, "pushToken:copy Failed to allocate memory.\n");
+               exit(-1);
+          }
+          memcpy(copy, token, len);
+          memcpy(r->data + at + sizeof(rec), &copy, sizeof(copy));
+     } else if (len > 0){
+          memcpy(r->data + at + sizeof(rec), token, len);
+     }
+     r->writeAt += size;
+     if (r->writeAt - __atomic_load_n(&r->tail, __ATOMIC_RELAXED) >= r->cap / 8){
+          ringPublish(r, &r->tail, r->writeAt);
+     }
+     return 1;
+}
+
+//The token is a view into the ring, valid until the next call like getToken's views into the input.
+//Its record is only handed back to the lexer stage on the next call.
+const char* streamToken(Lexer* lx, int* len) {
+     ByteRing* r = &lx->stream->tokens;
+     TokenRecord rec;
+     const char* token;
+     long at;
+
+     free(lx->spilled);
+     lx->spilled = NULL;
+     if (lx->eof){ //Line and offset stay at EoF
+          return NULL;
+     }
+     if (r->readAt - __atomic_load_n(&r->head, __ATOMIC_RELAXED) >= r->cap / 8){
+          ringPublish(r, &r->head, r->readAt);
+     }
+     while (1){
+          if (ringData(r) == 0){ //Lexer stage always ends with TOKEN_EOF, only when it was stopped
+               lx->eof = 1;
+               return NULL;
+          }
+          at = r->readAt & (r->cap - 1);
+          memcpy(&rec, r->data + at, sizeof(rec));
+          if (rec.len != TOKEN_WRAP){
+               break;
+          }
+          r->readAt += r->cap - at;
+     }
+     r->readAt += recordSize(&rec);
+     lx->linenum = rec.linenum;
+     lx->lineoffset = rec.lineoffset;
+     if (rec.len == TOKEN_EOF){
+          lx->eof = 1;
+          return NULL;
+     }
+     token = r->data + at + sizeof(rec);
+     if (rec.spilled){
+          memcpy(&lx->spilled, token, sizeof(lx->spilled));
+          token = lx->spilled;
+     }
+     *len = rec.len;
+     return token;
+}
+
+long recordSize(const TokenRecord* rec) {
+     long size = sizeof(TokenRecord);
+     if (rec->spilled){
+          size += sizeof(char*);
+     } else if (rec->len > 0){
+          size += rec->len;
+     }
+     return (size + 15) & ~15L; //Records stay 16 byte aligned, padding at the end of the ring fits a header
+}
+
+void streamLexer(Lexer* lx) {
+     munmap(lx->buf, lx->size); //File position is still 0, mapping does not move it
+     lx->cap = 1 << 16;
+     lx->buf = (char*)malloc(lx->cap);
+     if (lx->buf == NULL){
+          fprintf(stderr, "streamLexer:buf Failed to allocate memory.\n");
+          exit(-1);
+     }
+     lx->size = 0;
+     lx->eof = 0;
+}
+
+void initRing(ByteRing* r, long cap) {
+     memset(r, 0, sizeof(ByteRing));
+     r->cap = cap;
+     r->data = (char*)malloc(cap);
+     __atomic_add_fetch(&heapAllocs, 1, __ATOMIC_RELAXED);
+     if (r->data == NULL){
+          fprintf(stderr, "initRing:data Failed to allocate memory.\n");
+          exit(-1);
+     }
+     pthread_mutex_init(&r->lock, NULL);
+     pthread_cond_init(&r->cond, NULL);
+}
+
+void freeRing(ByteRing* r) {
+     free(r->data);
+     pthread_mutex_destroy(&r->lock);
+     pthread_cond_destroy(&r->cond);
+}
+
+long ringSpace(ByteRing* r, long need) {
+     long head;
+     while (1){
+          if (__atomic_load_n(&r->abandoned, __ATOMIC_ACQUIRE)){
+               return 0;
+          }
+          head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+          if (r->writeAt + need - head <= r->cap){
+               return r->cap - (r->writeAt - head);
+          }
+          ringPublish(r, &r->tail, r->writeAt); //The consumer may be waiting for what is written
+          ringWait(r, &r->head, head);
+     }
+}
+
+long ringData(ByteRing* r) {
+     long tail;
+     while (1){
+          if (__atomic_load_n(&r->abandoned, __ATOMIC_ACQUIRE)){
+               return 0;
+          }
+          tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+          if (tail != r->readAt){
+               return tail - r->readAt;
+          }
+          if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)
+               && __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->readAt){ //Last bytes are published before closed
+               return 0;
+          }
+          ringPublish(r, &r->head, r->readAt); //The producer may be waiting for room
+          ringWait(r, &r->tail, tail);
+     }
+}
+
+//Positions are stored before the sleeper count is read, and a sleeper counts itself before it
+//checks the position again, so either the sleeper sees the new position or the waker sees it.
+void ringPublish(ByteRing* r, long* pos, long value) {
+     if (__atomic_load_n(pos, __ATOMIC_RELAXED) == value){
+          return;
+     }
+     __atomic_store_n(pos, value, __ATOMIC_SEQ_CST);
+     if (__atomic_load_n(&r->sleepers, __ATOMIC_SEQ_CST) > 0){
+          pthread_mutex_lock(&r->lock);
+          pthread_cond_broadcast(&r->cond);
+          pthread_mutex_unlock(&r->lock);
+     }
+}
+
+void ringWait(ByteRing* r, long* pos, long seen) {
+     int spins;
+     for (spins = 0; spins<16; spins++){ //The other side is usually about to move, sleeping costs more
+          if (__atomic_load_n(pos, __ATOMIC_ACQUIRE) != seen || __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)
+               || __atomic_load_n(&r->abandoned, __ATOMIC_ACQUIRE)){
+               return;
+          }
+          sched_yield();
+     }
+     pthread_mutex_lock(&r->lock);
+     __atomic_add_fetch(&r->sleepers, 1, __ATOMIC_SEQ_CST);
+     while (__atomic_load_n(pos, __ATOMIC_SEQ_CST) == seen && !__atomic_load_n(&r->closed, __ATOMIC_SEQ_CST)
+          && !__atomic_load_n(&r->abandoned, __ATOMIC_SEQ_CST)){
+          pthread_cond_wait(&r->cond, &r->lock);
+     }
+     __atomic_sub_fetch(&r->sleepers, 1, __ATOMIC_SEQ_CST);
+     pthread_mutex_unlock(&r->lock);
+}
+
+void ringEnd(ByteRing* r, int* flag) {
+     __atomic_store_n(flag, 1, __ATOMIC_SEQ_CST);
+     pthread_mutex_lock(&r->lock);
+     pthread_cond_broadcast(&r->cond);
+     pthread_mutex_unlock(&r->lock);
+}
+
+void passTwo(LinkContext* ctx) {
+     int m;
+     RelocWorker w; //Serial mode relocates on this thread
+     OutBuf out; //Output of one module
+     long long t; //Phase start for --stats
+
+     if (ctx->cache != NULL){
+          passTwoIncremental(ctx);
+          return;
+     }
+     t = ctx->statsOn ? nowNanos() : 0;
+     if (ctx->imagePath != NULL){
+          openImage(ctx); //Symbols are written with the image, rule 2 goes to the diags
+     } else{
+          printSymbolTable(&ctx->out, ctx->symTable); //Starting the printing process
+     }
+     STAT_TIME(ctx, symtabNanos, t);
+
+     t = ctx->statsOn ? nowNanos() : 0;
+     //An image whose modules overlap, after a negative length, is relocated in module order so later words win
+     if (ctx->jobs > 1 && ctx->program->modCount > 1 && (ctx->imagePath == NULL || ctx->program->instrCount == ctx->imageWords)){
+          relocateParallel(ctx);
+     } else{
+          initRelocWorker(ctx, &w);
+          initOutBuf(&out, -1);
+          for (m=0; m<ctx->program->modCount; m++){
+               relocateModule(&ctx->program->modules[m], &w, &out);
+               writeOutBuf(ctx->report, &out);
+          }
+          free(out.data);
+          mergeRelocWorker(&w);
+     }
+     STAT_TIME(ctx, relocateNanos, t);
+     t = ctx->statsOn ? nowNanos() : 0;
+     rule4Violation(ctx); //Checking for rule 4 violation
+     STAT_TIME(ctx, rule4Nanos, t);
+     if (ctx->imagePath != NULL){
+          closeImage(ctx);
+     }
+}
+
+ConcurrentTable* createConcurrentTable(Program* p, int first, int count){
+     ConcurrentTable* t = (ConcurrentTable*)malloc(sizeof(ConcurrentTable));
+     if (t != NULL){
+          for (t->cap = 4; t->cap < count*2; t->cap *= 2); //Load factor at or below 1/2
+          t->slots = (int*)calloc(t->cap, sizeof(int)); //All slots empty
+          t->hashes = (unsigned int*)malloc((count + 1) * sizeof(unsigned int));
+          t->owner = (int*)malloc((count + 1) * sizeof(int));
+          t->dup = (unsigned char*)calloc(count + 1, 1);
+     }
+     __atomic_add_fetch(&heapAllocs, 5, __ATOMIC_RELAXED);
+     if (t == NULL || t->slots == NULL || t->hashes == NULL || t->owner == NULL || t->dup == NULL){
+          fprintf(stderr, "createConcurrentTable: Failed to allocate memory.\n");
+          exit(-1);
+     }
+     t->strings = p->strings;
+     t->defs = p->defs;
+     t->first = first;
+     return t;
+}
+
+void deallocConcurrentTable(ConcurrentTable* t){
+     free(t->slots);
+     free(t->hashes);
+     free(t->owner);
+     free(t->dup);
+     free(t);
+}
+
+//Lock free, a def lost to a lower def of its name, on insert or later, gets its dup flag set by
+//the thread that found out, only once since a def out of the slots never comes back.
+void concurrentInsert(ConcurrentTable* t, int d){
+     unsigned int hash = t->hashes[d - t->first];
+     const char* name = t->strings + t->defs[d].sym;
+     int slot, mask, cur, other;
+
+     mask = t->cap - 1;
+     for (slot = hash & mask; ; slot = (slot + 1) & mask){ //Linear probing
+          cur = __atomic_load_n(&t->slots[slot], __ATOMIC_ACQUIRE);
+          if (cur == 0 && __atomic_compare_exchange_n(&t->slots[slot], &cur, d + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+               return; //First of its name so far
+          }
+          other = cur - 1; //Set by the failed CAS when another def took the slot first
+          if (t->hashes[other - t->first] != hash || strcmp(t->strings + t->defs[other].sym, name) != 0){
+               continue; //Slot of another name
+          }
+          while (1){ //Same name, the lower def keeps the slot
+               if (other < d){
+                    t->dup[d - t->first] = 1;
+                    return;
+               }
+               if (__atomic_compare_exchange_n(&t->slots[slot], &cur, d + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+                    t->dup[other - t->first] = 1;
+                    return;
+               }
+               other = cur - 1; //Replaced meanwhile, by a def of the same name
+          }
+     }
+}
+
+int concurrentFind(ConcurrentTable* t, const char* name, unsigned int hash){
+     int slot, mask, cur;
+     mask = t->cap - 1;
+     for (slot = hash & mask; (cur = __atomic_load_n(&t->slots[slot], __ATOMIC_ACQUIRE)) != 0; slot = (slot + 1) & mask){
+          if (t->hashes[cur - 1 - t->first] == hash && strcmp(t->strings + t->defs[cur - 1].sym, name) == 0){
+               return cur - 1;
+          }
+     }
+     return -1;
+}
+
+void* defineWorkerMain(void* arg){
+     DefineWorker* w = (DefineWorker*)arg;
+     ConcurrentTable* t = w->table;
+     const char* name;
+     int d, b;
+
+     for (d = w->begin; d<w->end; d++){
+          b = d - t->first;
+          name = t->strings + t->defs[d].sym;
+          t->hashes[b] = hashString(name);
+          t->owner[b] = findSymbolHashed(w->symTable, name, t->hashes[b]); //Defined before the batch?
+          if (t->owner[b] == -1){
+               concurrentInsert(t, d);
+          }
+     }
+     return NULL;
+}
+
+void relocateModule(ModuleIR* modIR, RelocWorker* w, OutBuf* out) {
+     LinkContext* ctx = w->ctx;
+     int i, instCount;
+     long long t; //rule 7 start for --stats
+     RelocKernel k; //What relocateInstrs needs to know about the module
+     const char* modes; //Address modes of the module's instructions
+     int* words; //Relocated words
+     long long* wide; //Relocated words in large mode
+     signed char* errs; //Per word, rule it broke or 0
+     SymbolTable* useList; //Holds symbols in use list
+     int* useAddr; //Per use list symbol, abs addr of its definition, 0 when not defined
+     int* useGlobal; //Per use list symbol, index of its definition in the symbol table, -1 when not defined
+     int* useName; //Per use list symbol, offset of its name in an image's string section
+
+     //Module init, base addr, id and memory map row were fixed in pass 1.
+     //The text prints rows back to back, an image puts words at their address
+     instCount = ctx->image != NULL ? modIR->mod.baseAddr : modIR->mod.outIndex;
+
+     //Building useList
+     resetArena(&w->scratch); //Previous module's use list is garbage now
+     useList = createSymbolTable(&w->scratch, modIR->useCount, ctx->statsOn ? &ctx->stats : NULL); //use list init
+     useName = (int*)arenaAlloc(&w->scratch, (modIR->useCount + 1) * sizeof(int));
+     for (i=0; i<modIR->useCount; i++){
+          int k = addSymbolToTable(useList, ctx->program->strings + ctx->program->uses[modIR->useStart + i], modIR->mod, 0); //Add it to use list
+          if (k != -1){ //Image names are the symbol table's, then the program's
+               useName[k] = ctx->symTable->namesSize + ctx->program->uses[modIR->useStart + i];
+          }
+          STAT_ADD(ctx, symbolAllocs, 1);
+     }
+
+     //Relocating program text in one sweep, then marking the uses E instructions referenced.
+     //Most modules of a big link have no text, only their use lists matter for rule 7
+     words = NULL;
+     wide = NULL;
+     if (modIR->instrCount > 0){
+          //Resolving the use list once, E instructions index these arrays instead of looking up their symbol
+          useAddr = (int*)arenaAlloc(&w->scratch, (useList->size + 1) * sizeof(int));
+          useGlobal = (int*)arenaAlloc(&w->scratch, (useList->size + 1) * sizeof(int));
+          for (i=0; i<useList->size; i++){
+               useGlobal[i] = findSymbolHashed(ctx->symTable, SYM_NAME(useList, i), useList->hashes[i]);
+               useAddr[i] = useGlobal[i] != -1 ? ctx->symTable->absAddr[useGlobal[i]] : 0;
+          }
+          k.base = modIR->mod.baseAddr;
+          k.moduleSize = modIR->instrCount; //module length
+          k.useSize = useList->size;
+          k.useAddr = useAddr;
+          k.useGlobal = useGlobal;
+          k.useHits = (int*)arenaAlloc(&w->scratch, (useList->size + 1) * sizeof(int));
+          memset(k.useHits, 0, (useList->size + 1) * sizeof(int));
+          errs = (signed char*)arenaAlloc(&w->scratch, modIR->instrCount + 1);
+          modes = ctx->program->modes + modIR->instrStart;
+          if (ctx->large){
+               k.scale = ctx->operandScale;
+               k.machineSize = ctx->machineSize;
+               wide = (long long*)arenaAlloc(&w->scratch, (modIR->instrCount + 1) * sizeof(long long));
+               relocateWide(&k, modes, ctx->program->wide + modIR->instrStart, modIR->instrCount, wide, errs);
+          } else{
+               words = (int*)arenaAlloc(&w->scratch, (modIR->instrCount + 1) * sizeof(int));
+               relocateInstrs(&k, modes, ctx->program->words + modIR->instrStart, modIR->instrCount, words, errs);
+          }
+          for (i=0; i<useList->size; i++){
+               if (k.useHits[i] > 0){
+                    BIT_SET(useList->used, i); //Use symbol used, for rule 7
+                    if (useGlobal[i] >= 0){
+                         BIT_SET(w->usedBits, useGlobal[i]); //Definition used, merged after relocation
+                    }
+               }
+          }
+     }
+
+     //Writing the words out
+     for (i=0; i<modIR->instrCount; i++){
+          int operand;
+          if (ctx->large){ //Wider columns, never an image
+               outInt(out, instCount, ctx->addrWidth);
+               outBytes(out, ": ", 2);
+               outInt(out, wide[i], ctx->operandWidth + 1);
+               outBytes(out, " ", 1);
+               if (errs[i] != 0){
+                    operand = (int)(ctx->program->wide[modIR->instrStart + i] % ctx->operandScale);
+                    __nonTerminatingError(out, errs[i], errs[i] == 3 ? SYM_NAME(useList, operand) : ctx->illegalWord);
+               } else{
+                    outBytes(out, "\n", 1);
+               }
+               instCount += 1;
+               continue;
+          }
+          operand = ctx->program->words[modIR->instrStart + i] % 1000; //Use list index of a rule 3 error
+          if (ctx->image != NULL){ //Word goes to its address in the image, the error to the diags
+               if (instCount >= 0 && instCount < ctx->imageWords){
+                    ctx->image[instCount] = words[i];
+               } else{ //Negative lengths can move a module below 0, the word has no address in the image
+                    addDiag(out, IMAGE_DIAG_OUTSIDE, instCount, modIR->mod.id, -1);
+               }
+               if (errs[i] != 0){
+                    addDiag(out, errs[i], instCount, modIR->mod.id, errs[i] == 3 ? useName[operand] : -1);
+               }
+               instCount += 1;
+               continue;
+          }
+          outInt(out, instCount, 3); //"%03d: %04d "
+          outBytes(out, ": ", 2);
+          outInt(out, words[i], 4);
+          outBytes(out, " ", 1);
+          if (errs[i] != 0){ //There is an error, print the error message
+               __nonTerminatingError(out, errs[i], errs[i] == 3 ? SYM_NAME(useList, operand) : NULL);
+          } else{ //No error, printing a new line
+               outBytes(out, "\n", 1);
+          }
+          instCount += 1; //Updating instr counter
+     }
+     t = ctx->statsOn ? nowNanos() : 0;
+     rule7Violation(ctx, out, useList, useName); //Checking for rule 7 violation
+     STAT_TIME(ctx, rule7Nanos, t);
+     if (w->useUsed != NULL){ //Relink cache records which uses mattered
+          for (i=0; i<modIR->useCount; i++){
+               w->useUsed[i] = BIT_TEST(useList->used, findSymbolInTable(useList, ctx->program->strings + ctx->program->uses[modIR->useStart + i]));
+          }
+     }
+}
+
+//Relocates a module's instructions, modes and words in separate arrays, in one sweep without a
+//branch per address mode. Every mode's result is worked out for each word and a table indexed by
+//the mode picks one, so the loop body is the same straight line code for all words.
+//Rules 10 and 11 are one test: for every word opcode >= 10 is op >= 10000, the rule I checks.
+//E operands outside the use list, negative ones included, break rule 6. Hits on each use are
+//counted in useHits, the caller marks them. errs gets the rule a word broke, 0 for none.
+void relocateInstrs(const RelocKernel* k, const char* modes, const int* words, int count, int* out, signed char* errs){
+     static const unsigned char modeIndex[256] = {['I'] = 1, ['E'] = 2, ['A'] = 3, ['R'] = 4}; //0 leaves the word alone
+     static const signed char illegalErr[5] = {0, 10, 11, 11, 11}; //Rule broken by a word of 10000 and up, per mode
+     int i, m, op, opcode, operand, illegal, inUse, idx;
+     int operands[5]; //Per mode, the relocated operand
+     int ruleOf[5]; //Per mode, the rule broken or 0
+
+     for (i=0; i<count; i++){
+          m = modeIndex[(unsigned char)modes[i]];
+          op = words[i];
+          opcode = op/1000;
+          operand = op - opcode*1000; //op%1000
+          illegal = (op >= 10000) & (m != 0);
+
+          operands[0] = operand;
+          ruleOf[0] = 0;
+          operands[1] = operand; //I
+          ruleOf[1] = 0;
+          inUse = (unsigned int)operand < (unsigned int)k->useSize; //E, rule 6 otherwise
+          idx = inUse ? operand : 0; //useAddr and useGlobal have a slot 0 even when empty
+          operands[2] = inUse ? k->useAddr[idx] : operand; //0 for rule 3
+          ruleOf[2] = inUse ? (k->useGlobal[idx] < 0 ? 3 : 0) : 6;
+          k->useHits[idx] += inUse & (m == 2) & !illegal;
+          operands[3] = operand > 512 ? 0 : operand; //A, rule 8 past the machine size
+          ruleOf[3] = operand > 512 ? 8 : 0;
+          operands[4] = (operand > k->moduleSize ? 0 : operand) + k->base; //R, rule 9 past the module
+          ruleOf[4] = operand > k->moduleSize ? 9 : 0;
+
+          out[i] = illegal ? 9999 : opcode*1000 + operands[m];
+          errs[i] = illegal ? illegalErr[m] : ruleOf[m];
+     }
+}
+
+//relocateInstrs for large mode, 64 bit words are split at 10^operandWidth instead of 1000, illegal
+//ones become all nines, and A operands are checked against the machine size. Same rules otherwise.
+void relocateWide(const RelocKernel* k, const char* modes, const long long* words, int count, long long* out, signed char* errs){
+     static const unsigned char modeIndex[256] = {['I'] = 1, ['E'] = 2, ['A'] = 3, ['R'] = 4};
+     static const signed char illegalErr[5] = {0, 10, 11, 11, 11};
+     long long op, opcode, operand;
+     long long operands[5];
+     int ruleOf[5];
+     int i, m, illegal, inUse, idx;
+
+     for (i=0; i<count; i++){
+          m = modeIndex[(unsigned char)modes[i]];
+          op = words[i];
+          opcode = op / k->scale;
+          operand = op - opcode*k->scale;
+          illegal = (op >= 10*k->scale) & (m != 0);
+
+          operands[0] = operand;
+          ruleOf[0] = 0;
+          operands[1] = operand;
+          ruleOf[1] = 0;
+          inUse = (unsigned long long)operand < (unsigned long long)k->useSize;
+          idx = inUse ? (int)operand : 0;
+          operands[2] = inUse ? k->useAddr[idx] : operand;
+          ruleOf[2] = inUse ? (k->useGlobal[idx] < 0 ? 3 : 0) : 6;
+          k->useHits[idx] += inUse & (m == 2) & !illegal;
+          operands[3] = operand >= k->machineSize ? 0 : operand;
+          ruleOf[3] = operand >= k->machineSize ? 8 : 0;
+          operands[4] = (operand > k->moduleSize ? 0 : operand) + k->base;
+          ruleOf[4] = operand > k->moduleSize ? 9 : 0;
+
+          out[i] = illegal ? 10*k->scale - 1 : opcode*k->scale + operands[m];
+          errs[i] = illegal ? illegalErr[m] : ruleOf[m];
+     }
+}
+
+void initRelocWorker(LinkContext* ctx, RelocWorker* w) {
+     initArena(&w->scratch, 1 << 12);
+     w->ctx = ctx;
+     w->useUsed = NULL;
+     w->usedBits = (unsigned char*)calloc(ctx->symTable->size / 8 + 1, 1);
+     __atomic_add_fetch(&heapAllocs, 1, __ATOMIC_RELAXED);
+     if (w->usedBits == NULL){
+          fprintf(stderr, "initRelocWorker:usedBits Failed to allocate memory.\n");
+          exit(-1);
+     }
+}
+
+void mergeRelocWorker(RelocWorker* w) {
+     LinkContext* ctx = w->ctx;
+     int i;
+     for (i = 0; i<ctx->symTable->size / 8 + 1; i++){ //Only this thread writes used now, both bitsets cover the whole table
+          ctx->symTable->used[i] |= w->usedBits[i];
+     }
+     ctx->scratchAllocs.allocs += w->scratch.allocs;
+     ctx->scratchAllocs.blocks += w->scratch.blocks;
+     ctx->scratchAllocs.bytes += w->scratch.bytes;
+     ctx->scratchAllocs.resets += w->scratch.resets;
+     freeArena(&w->scratch);
+     free(w->usedBits);
+}
+
+void relocateParallel(LinkContext* ctx) {
+     RelocQueue q;
+     RelocWorker* workers;
+     int i, m, slot, jobs;
+
+     jobs = ctx->jobs;
+     q.next = 0;
+     q.written = 0;
+     q.window = jobs * 16; //Bounds buffered output while keeping workers busy
+     q.slots = (OutBuf*)malloc(q.window * sizeof(OutBuf));
+     q.done = (int*)calloc(q.window, sizeof(int));
+     workers = (RelocWorker*)malloc(jobs * sizeof(RelocWorker));
+     __atomic_add_fetch(&heapAllocs, 3, __ATOMIC_RELAXED);
+     if (q.slots == NULL || q.done == NULL || workers == NULL){
+          fprintf(stderr, "relocateParallel: Failed to allocate memory.\n");
+          exit(-1);
+     }
+     for (i = 0; i<q.window; i++){
+          initOutBuf(&q.slots[i], -1);
+     }
+     pthread_mutex_init(&q.lock, NULL);
+     pthread_cond_init(&q.cond, NULL);
+
+     //Symbol table and module list are read only from here on
+     for (i = 0; i<jobs; i++){
+          initRelocWorker(ctx, &workers[i]);
+          workers[i].queue = &q;
+          if (pthread_create(&workers[i].tid, NULL, relocWorkerMain, &workers[i]) != 0){
+               fprintf(stderr, "relocateParallel: Failed to create thread.\n");
+               exit(-1);
+          }
+     }
+     //This thread writes module outputs in module order as they complete
+     for (m = 0; m<ctx->program->modCount; m++){
+          slot = m % q.window;
+          pthread_mutex_lock(&q.lock);
+          while (q.done[slot] == 0){
+               pthread_cond_wait(&q.cond, &q.lock);
+          }
+          pthread_mutex_unlock(&q.lock);
+          writeOutBuf(ctx->report, &q.slots[slot]);
+          pthread_mutex_lock(&q.lock);
+          q.done[slot] = 0;
+          q.written = m + 1;
+          pthread_cond_broadcast(&q.cond);
+          pthread_mutex_unlock(&q.lock);
+     }
+     for (i = 0; i<jobs; i++){
+          pthread_join(workers[i].tid, NULL);
+          mergeRelocWorker(&workers[i]); //Rule 4 marks, race free once joined
+     }
+     pthread_mutex_destroy(&q.lock);
+     pthread_cond_destroy(&q.cond);
+     for (i = 0; i<q.window; i++){
+          free(q.slots[i].data);
+     }
+     free(q.slots);
+     free(q.done);
+     free(workers);
+}
+
+void* relocWorkerMain(void* arg) {
+     RelocWorker* w = (RelocWorker*)arg;
+     RelocQueue* q = w->queue;
+     LinkContext* ctx = w->ctx;
+     int m;
+
+     while (1){
+          pthread_mutex_lock(&q->lock);
+          m = q->next;
+          if (m >= ctx->program->modCount){
+               pthread_mutex_unlock(&q->lock);
+               return NULL;
+          }
+          q->next += 1;
+          while (m >= q->written + q->window){ //Slot still holds an unwritten module
+               pthread_cond_wait(&q->cond, &q->lock);
+          }
+          pthread_mutex_unlock(&q->lock);
+
+          relocateModule(&ctx->program->modules[m], w, &q->slots[m % q->window]);
+
+          pthread_mutex_lock(&q->lock);
+          q->done[m % q->window] = 1;
+          pthread_cond_broadcast(&q->cond);
+          pthread_mutex_unlock(&q->lock);
+     }
+}
+
+void initLexer(Lexer* lx, const char* filename) {
+     if (filename == NULL || strcmp(filename,"-") == 0){ //Reading from stdin, can only be read once
+          lx->fd = 0;
+     } else{
+          lx->fd = open(filename, O_RDONLY);
+     }
+     if (lx->fd < 0) {
+          fprintf(stderr, "Cannot open file: %s.\n", filename);
+          exit(-1);
+     }
+     initLexerFd(lx, lx->fd);
+}
+
+void initLexerFd(Lexer* lx, int fd) {
+     struct stat st;
+     void* map;
+
+     lx->fd = fd;
+     lx->buf = NULL;
+     lx->size = 0;
+     lx->cap = 0;
+     lx->base = 0;
+     lx->pos = 0;
+     lx->lineStart = 0;
+     lx->eof = 0;
+     lx->inLine = 0;
+     lx->linenum = 0;
+     lx->lineoffset = 0;
+     lx->finalPosition = 0;
+     lx->onError = NULL;
+     lx->name = NULL;
+     lx->ctx = NULL;
+     lx->borrowed = 0;
+     lx->blockStart = 0;
+     lx->blockEnd = 0;
+     lx->source = NULL;
+     lx->stream = NULL;
+     lx->spilled = NULL;
+
+     //Regular files are mapped whole, tokens are views into the mapping
+     if (fstat(lx->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+          map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, lx->fd, 0); //Writable so object files number modules in place
+          if (map != MAP_FAILED){
+               madvise(map, st.st_size, MADV_SEQUENTIAL);
+               lx->buf = (char*)map;
+               lx->size = st.st_size;
+               lx->eof = 1;
+               return;
+          }
+     }
+     //Pipes, terminals and empty files go through a read buffer
+     lx->cap = 1 << 16;
+     lx->buf = (char*)malloc(lx->cap);
+     if (lx->buf == NULL){
+          fprintf(stderr, "initLexer:buf Failed to allocate memory.\n");
+          exit(-1);
+     }
+}
+
+//Input held in memory is read in place like a mapped file, text is never written to.
+//Object files are numbered in place, so those are copied and the copy is freed on close.
+void initLexerBuffer(Lexer* lx, const char* buf, long size) {
+     memset(lx, 0, sizeof(Lexer));
+     lx->fd = -1; //No file behind it
+     lx->buf = (char*)buf;
+     lx->size = size;
+     lx->eof = 1;
+     lx->borrowed = 1;
+     if (size >= 8 && memcmp(buf, OBJ_MAGIC, 8) == 0){
+          lx->buf = (char*)malloc(size);
+          if (lx->buf == NULL){
+               fprintf(stderr, "initLexerBuffer:buf Failed to allocate memory.\n");
+               exit(-1);
+          }
+          memcpy(lx->buf, buf, size);
+          lx->cap = size;
+          lx->borrowed = 0;
+     }
+}
+
+void closeLexer(Lexer* lx) {
+     if (lx->cap > 0){
+          free(lx->buf);
+     } else if (!lx->borrowed){ //The caller's memory is left alone
+          munmap(lx->buf, lx->size);
+     }
+     if (lx->fd > 0){
+          close(lx->fd);
+     }
+}
+
+int refillLexer(Lexer* lx, long keep) {
+     long n;
+     if (lx->eof){
+          return 0;
+     }
+     //Dropping bytes before keep, the rest moves to the front
+     memmove(lx->buf, lx->buf + keep, lx->size - keep);
+     lx->blockEnd = lx->blockStart; //Bytes moved, the block masks are stale
+     lx->base += keep;
+     lx->size -= keep;
+     lx->pos -= keep;
+     if (lx->size == lx->cap){ //A token fills the buffer
+          lx->cap *= 2;
+          lx->buf = (char*)realloc(lx->buf, lx->cap);
+          if (lx->buf == NULL){
+               fprintf(stderr, "refillLexer:buf Failed to allocate memory.\n");
+               exit(-1);
+          }
+     }
+     do{
+          n = lx->source != NULL ? pipelineRead(lx->source, lx->buf + lx->size, lx->cap - lx->size) : read(lx->fd, lx->buf + lx->size, lx->cap - lx->size);
+     } while (n < 0 && errno == EINTR);
+     if (n <= 0){ //EoF or Error in read
+          lx->eof = 1;
+          return 0;
+     }
+     lx->size += n;
+     return 1;
+}
+
+Program* createProgram(){
+     Program* p = (Program*)calloc(1, sizeof(Program)); //All lists start empty
+     if (p == NULL){
+          fprintf(stderr, "createProgram:p Failed to allocate memory.\n");
+          exit(-1);
+     }
+     return p;
+}
+
+void deallocProgram(Program* p){
+     if (p->mapped){ //Lists belong to the object file
+          free(p);
+          return;
+     }
+     free(p->modules);
+     free(p->defs);
+     free(p->uses);
+     free(p->modes);
+     free(p->words);
+     free(p->wide);
+     free(p->strings);
+     free(p);
+}
+
+void* growArray(void* arr, int* cap, int elemSize, const char* who){
+     *cap = (*cap == 0) ? 16 : *cap * 2; //Doubling capacity
+     arr = realloc(arr, (size_t)*cap * elemSize);
+     __atomic_add_fetch(&heapAllocs, 1, __ATOMIC_RELAXED); //Chunk parsers grow their programs on threads
+     if (arr == NULL){
+          fprintf(stderr, "%s Failed to allocate memory.\n", who);
+          exit(-1);
+     }
+     return arr;
+}
+
+ModuleIR* addModuleToProgram(Program* p, Module m){
+     ModuleIR* modIR;
+     if (p->modCount == p->modCap){
+          p->modules = growArray(p->modules, &p->modCap, sizeof(ModuleIR), "addModuleToProgram:modules");
+     }
+     modIR = &p->modules[p->modCount];
+     p->modCount += 1;
+     modIR->mod = m;
+     modIR->defStart = p->defCount;
+     modIR->defCount = 0;
+     modIR->useStart = p->useCount;
+     modIR->useCount = 0;
+     modIR->instrStart = p->instrCount;
+     modIR->instrCount = 0;
+     modIR->length = 0;
+     return modIR;
+}
+
+void copyModuleToProgram(Program* dst, Program* src, ModuleIR* m){
+     ModuleIR* modIR;
+     int i;
+     char* sym;
+     modIR = addModuleToProgram(dst, m->mod);
+     modIR->length = m->length;
+     for (i=0; i<m->defCount; i++){
+          sym = src->strings + src->defs[m->defStart + i].sym;
+          addDefToProgram(dst, modIR, sym, strlen(sym), src->defs[m->defStart + i].relAddr);
+     }
+     for (i=0; i<m->useCount; i++){
+          sym = src->strings + src->uses[m->useStart + i];
+          addUseToProgram(dst, modIR, sym, strlen(sym));
+     }
+     for (i=0; i<m->instrCount; i++){
+          if (src->wide != NULL){ //Large mode program
+               addWideInstrToProgram(dst, modIR, src->modes[m->instrStart + i], src->wide[m->instrStart + i]);
+          } else{
+               addInstrToProgram(dst, modIR, src->modes[m->instrStart + i], src->words[m->instrStart + i]);
+          }
+     }
+}
+
+void addDefToProgram(Program* p, ModuleIR* modIR, const char* sym, int len, int rel){
+     if (p->defCount == p->defCap){
+          p->defs = growArray(p->defs, &p->defCap, sizeof(Def), "addDefToProgram:defs");
+     }
+     p->defs[p->defCount].sym = addStringToProgram(p, sym, len);
+     p->defs[p->defCount].relAddr = rel;
+     p->defCount += 1;
+     modIR->defCount += 1;
+}
+
+void addUseToProgram(Program* p, ModuleIR* modIR, const char* sym, int len){
+     if (p->useCount == p->useCap){
+          p->uses = growArray(p->uses, &p->useCap, sizeof(int), "addUseToProgram:uses");
+     }
+     p->uses[p->useCount] = addStringToProgram(p, sym, len);
+     p->useCount += 1;
+     modIR->useCount += 1;
+}
+
+void addInstrToProgram(Program* p, ModuleIR* modIR, char mode, int word){
+     if (p->instrCount == p->instrCap){
+          int wordCap = p->instrCap; //Both arrays share one capacity
+          p->modes = growArray(p->modes, &p->instrCap, sizeof(char), "addInstrToProgram:modes");
+          p->words = growArray(p->words, &wordCap, sizeof(int), "addInstrToProgram:words");
+     }
+     p->modes[p->instrCount] = mode;
+     p->words[p->instrCount] = word;
+     p->instrCount += 1;
+     modIR->instrCount += 1;
+}
+
+void addWideInstrToProgram(Program* p, ModuleIR* modIR, char mode, long long word){
+     if (p->instrCount == p->instrCap){
+          int wordCap = p->instrCap; //Both arrays share one capacity
+          p->modes = growArray(p->modes, &p->instrCap, sizeof(char), "addWideInstrToProgram:modes");
+          p->wide = growArray(p->wide, &wordCap, sizeof(long long), "addWideInstrToProgram:wide");
+     }
+     p->modes[p->instrCount] = mode;
+     p->wide[p->instrCount] = word;
+     p->instrCount += 1;
+     modIR->instrCount += 1;
+}
+
+int addStringToProgram(Program* p, const char* str, int len){
+     int offset;
+     while (p->strSize + len + 1 > p->strCap){ //Keeping room for the null char
+          p->strings = growArray(p->strings, &p->strCap, sizeof(char), "addStringToProgram:strings");
+     }
+     offset = p->strSize;
+     memcpy(p->strings + offset, str, len);
+     p->strings[offset + len] = '\0';
+     p->strSize += len + 1;
+     return offset;
+}
+
+void initArena(Arena* a, size_t blockSize){
+     a->first = NULL;
+     a->cur = NULL;
+     a->blockSize = blockSize;
+     a->allocs = 0;
+     a->blocks = 0;
+     a->bytes = 0;
+     a->resets = 0;
+}
+
+void* arenaAlloc(Arena* a, size_t n){
+     ArenaBlock* b;
+     void* p;
+
+     n = (n + 7) & ~(size_t)7; //Keeping every allocation 8 byte aligned
+     a->allocs += 1;
+     if (a->cur != NULL && a->cur->used + n <= a->cur->size){ //Fast path, bump the pointer
+          p = a->cur->data + a->cur->used;
+          a->cur->used += n;
+          return p;
+     }
+     //Current block is full, reuse the next one if a reset left it behind
+     while (a->cur != NULL && a->cur->next != NULL){
+          a->cur = a->cur->next;
+          if (n <= a->cur->size){
+               a->cur->used = n;
+               return a->cur->data;
+          }
+     }
+     b = (ArenaBlock*)malloc(sizeof(ArenaBlock) + (n > a->blockSize ? n : a->blockSize));
+     if (b == NULL){
+          fprintf(stderr, "arenaAlloc:b Failed to allocate memory.\n");
+          exit(-1);
+     }
+     b->next = NULL;
+     b->size = n > a->blockSize ? n : a->blockSize;
+     b->used = n;
+     a->blocks += 1;
+     a->bytes += b->size;
+     if (a->blockSize < (1 << 20)){ //Fewer blocks for big links, 1MB cap
+          a->blockSize *= 2;
+     }
+     if (a->cur == NULL){
+          a->first = b;
+     } else{
+          a->cur->next = b;
+     }
+     a->cur = b;
+     return b->data;
+}
+
+void resetArena(Arena* a){
+     ArenaBlock* b;
+     for (b = a->first; b != NULL; b = b->next){
+          b->used = 0;
+     }
+     a->cur = a->first;
+     a->resets += 1;
+}
+
+void freeArena(Arena* a){
+     ArenaBlock* b;
+     while (a->first != NULL){
+          b = a->first;
+          a->first = b->next;
+          free(b);
+     }
+     a->cur = NULL;
+}
+
+void printAllocStats(LinkContext* ctx){
+     fprintf(stderr, "Allocations\n");
+     fprintf(stderr, "link arena: %ld allocs, %ld blocks, %ld bytes\n", ctx->arena.allocs, ctx->arena.blocks, ctx->arena.bytes);
+     fprintf(stderr, "scratch arenas: %ld allocs, %ld blocks, %ld bytes, %ld resets\n", ctx->scratchAllocs.allocs, ctx->scratchAllocs.blocks, ctx->scratchAllocs.bytes, ctx->scratchAllocs.resets);
+     fprintf(stderr, "heap: %ld allocs\n", heapAllocs);
+}
+
+long long nowNanos(){
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void printStats(LinkContext* ctx){
+     LinkStats* s = &ctx->stats;
+     fprintf(stderr, "pass1_seconds=%.6f\n", s->passOneNanos / 1e9);
+     fprintf(stderr, "rule5_seconds=%.6f\n", s->rule5Nanos / 1e9);
+     fprintf(stderr, "symtab_print_seconds=%.6f\n", s->symtabNanos / 1e9);
+     fprintf(stderr, "relocate_seconds=%.6f\n", s->relocateNanos / 1e9);
+     fprintf(stderr, "rule7_seconds=%.6f\n", s->rule7Nanos / 1e9);
+     fprintf(stderr, "rule4_seconds=%.6f\n", s->rule4Nanos / 1e9);
+     fprintf(stderr, "pass2_seconds=%.6f\n", s->passTwoNanos / 1e9);
+     fprintf(stderr, "modules=%lld\n", s->modules);
+     fprintf(stderr, "instructions=%lld\n", s->instrs);
+     fprintf(stderr, "symbols=%lld\n", s->symbols);
+#ifdef LINK_STATS
+     fprintf(stderr, "tokens=%lld\n", s->tokens);
+     fprintf(stderr, "lines=%lld\n", s->lines);
+     fprintf(stderr, "symbol_lookups=%lld\n", s->lookups);
+     fprintf(stderr, "symbol_compares=%lld\n", s->compares);
+     fprintf(stderr, "symbol_allocs=%lld\n", s->symbolAllocs);
+     fprintf(stderr, "symbol_table_allocs=%lld\n", s->tableAllocs);
+#endif
+     fprintf(stderr, "bytes_written=%lld\n", ctx->out.written + (long long)ctx->out.size); //Still buffered bytes go out next
+}
+
+int isObjectInput(Lexer* lx){
+     while (lx->size < 8 && refillLexer(lx, 0)); //Piped input, reading at least the magic
+     return lx->size >= 8 && memcmp(lx->buf, OBJ_MAGIC, 8) == 0;
+}
+
+void loadObject(LinkContext* ctx, Lexer* lx, Program* p, const char* name){
+     while (refillLexer(lx, 0)); //Piped input, reading all of it, a mapped file is already whole
+     if (!mapObject(lx->buf, lx->size, p)){
+          failLink(ctx, LINK_BAD_OBJECT, "Invalid object file: %s.", name);
+     }
+}
+
+int mapObject(char* buf, long total, Program* p){
+     ObjHeader* h;
+     int i, bad;
+     ModuleIR* m;
+
+     h = (ObjHeader*)buf;
+     //Checking the sections fit, nothing is copied or parsed
+     bad = total < (long)sizeof(ObjHeader) || h->strSize < 1
+          || h->moduleOff < (long long)sizeof(ObjHeader) || h->moduleOff % OBJ_ALIGN || !sectionFits(h->moduleOff, h->moduleCount, sizeof(ModuleIR), total)
+          || h->defOff % OBJ_ALIGN || !sectionFits(h->defOff, h->defCount, sizeof(Def), total)
+          || h->useOff % OBJ_ALIGN || !sectionFits(h->useOff, h->useCount, sizeof(int), total)
+          || !sectionFits(h->modeOff, h->instrCount, 1, total)
+          || h->wordOff % OBJ_ALIGN || !sectionFits(h->wordOff, h->instrCount, sizeof(int), total)
+          || !sectionFits(h->strOff, h->strSize, 1, total);
+     if (!bad){
+          p->modules = (ModuleIR*)(buf + h->moduleOff);
+          p->defs = (Def*)(buf + h->defOff);
+          p->uses = (int*)(buf + h->useOff);
+          p->modes = buf + h->modeOff;
+          p->words = (int*)(buf + h->wordOff);
+          p->strings = buf + h->strOff;
+          bad = p->strings[h->strSize-1] != '\0'; //Last name is terminated
+     }
+     for (i=0; !bad && i<h->moduleCount; i++){
+          m = &p->modules[i];
+          bad = !sectionFits(m->defStart, m->defCount, 1, h->defCount)
+               || !sectionFits(m->useStart, m->useCount, 1, h->useCount)
+               || !sectionFits(m->instrStart, m->instrCount, 1, h->instrCount);
+     }
+     for (i=0; !bad && i<h->instrCount; i++){ //Relocation would leave a word of any other mode alone
+          bad = p->modes[i] != 'I' && p->modes[i] != 'E' && p->modes[i] != 'A' && p->modes[i] != 'R';
+     }
+     for (i=0; !bad && i<h->defCount; i++){
+          bad = p->defs[i].sym < 0 || p->defs[i].sym >= h->strSize;
+     }
+     for (i=0; !bad && i<h->useCount; i++){
+          bad = p->uses[i] < 0 || p->uses[i] >= h->strSize;
+     }
+     if (bad){ //The lists were the program's own, empty, before
+          p->modules = NULL;
+          p->defs = NULL;
+          p->uses = NULL;
+          p->modes = NULL;
+          p->words = NULL;
+          p->strings = NULL;
+          return 0;
+     }
+     p->modCount = h->moduleCount;
+     p->defCount = h->defCount;
+     p->useCount = h->useCount;
+     p->instrCount = h->instrCount;
+     p->strSize = h->strSize;
+     p->mapped = 1;
+     return 1;
+}
+
+//Checked against the room left after off, off + count*size could overflow for a damaged offset
+int sectionFits(long long off, long long count, long long size, long total){
+     return off >= 0 && off <= total && count >= 0 && count <= (total - off) / size;
+}
+
+void passOneObject(LinkContext* ctx, Lexer* lx, const char* name){
+     PassOne st;
+     ModuleIR* m;
+     int i;
+
+     loadObject(ctx, lx, ctx->program, name);
+     st.baseAddr = 0;
+     st.moduleId = 1;
+     st.totalInstr = 0;
+     st.outIndex = 0;
+     for (i=0; i<ctx->program->modCount; i++){
+          m = &ctx->program->modules[i];
+          checkObjectModule(ctx, &st, m, name);
+          defineModule(ctx, &st, ctx->program, m);
+     }
+}
+
+void checkObjectModule(LinkContext* ctx, PassOne* st, ModuleIR* m, const char* name){
+     if (ctx->large){ //Object words are classic ints
+          failLink(ctx, LINK_BAD_OBJECT, "Object files only link in classic mode: %s.", name);
+     }
+     //Text limits were checked by the converter, these only catch a damaged file
+     if (m->defCount > 16 || m->useCount > 16 || m->length > 512 || m->length > 512 - st->totalInstr
+          || m->instrCount != (m->length < 0 ? 0 : m->length)){
+          failLink(ctx, LINK_BAD_OBJECT, "Invalid object file: %s.", name);
+     }
+}
+
+void openArchives(LinkContext* ctx){
+     const ArchiveHeader* h;
+     Archive* ar;
+     int i, k, fd, bad;
+
+     ctx->archives = (Archive*)calloc(ctx->archiveCount, sizeof(Archive));
+     __atomic_add_fetch(&heapAllocs, 1, __ATOMIC_RELAXED);
+     if (ctx->archives == NULL){
+          fprintf(stderr, "openArchives:archives Failed to allocate memory.\n");
+          exit(-1);
+     }
+     for (k = 0; k<ctx->archiveCount; k++){
+          ar = &ctx->archives[k];
+          fd = open(ctx->archivePaths[k], O_RDONLY);
+          if (fd < 0){
+               failLink(ctx, LINK_IO_ERROR, "Cannot open file: %s.", ctx->archivePaths[k]);
+          }
+          initLexerFd(&ar->lex, fd);
+          ar->path = ctx->archivePaths[k];
+          while (refillLexer(&ar->lex, 0)); //Piped archive, reading all of it
+          //The object sections are checked by mapObject, the index here
+          h = (const ArchiveHeader*)ar->lex.buf;
+          bad = ar->lex.size < (long)sizeof(ArchiveHeader) || memcmp(h->obj.magic, ARCHIVE_MAGIC, 8) != 0
+               || !mapObject(ar->lex.buf, ar->lex.size, &ar->prog)
+               || h->symbolCount < 0 || h->hashCap < 1 || (h->hashCap & (h->hashCap - 1)) != 0 || h->hashCap < 2*(long long)h->symbolCount
+               || h->symbolOff % OBJ_ALIGN || !sectionFits(h->symbolOff, h->symbolCount, sizeof(ArchiveSymbol), ar->lex.size)
+               || h->hashOff % OBJ_ALIGN || !sectionFits(h->hashOff, h->hashCap, sizeof(int), ar->lex.size);
+          if (!bad){
+               ar->symbols = (const ArchiveSymbol*)(ar->lex.buf + h->symbolOff);
+               ar->slots = (const int*)(ar->lex.buf + h->hashOff);
+               ar->symbolCount = h->symbolCount;
+               ar->hashCap = h->hashCap;
+          }
+          for (i=0; !bad && i<ar->symbolCount; i++){
+               bad = ar->symbols[i].name < 0 || ar->symbols[i].name >= ar->prog.strSize || ar->symbols[i].module < 0 || ar->symbols[i].module >= ar->prog.modCount;
+          }
+          for (i=0; !bad && i<ar->hashCap; i++){
+               bad = ar->slots[i] < -1 || ar->slots[i] >= ar->symbolCount;
+          }
+          if (bad){
+               failLink(ctx, LINK_BAD_OBJECT, "Invalid archive file: %s.", ar->path);
+          }
+          ar->pulled = (unsigned char*)calloc(ar->prog.modCount > 0 ? ar->prog.modCount : 1, 1);
+          __atomic_add_fetch(&heapAllocs, 1, __ATOMIC_RELAXED);
+          if (ar->pulled == NULL){
+               fprintf(stderr, "openArchives:pulled Failed to allocate memory.\n");
+               exit(-1);
+          }
+     }
+}
+
+void closeArchives(LinkContext* ctx){
+     int k;
+     for (k = 0; k<ctx->archiveCount; k++){
+          if (ctx->archives[k].path != NULL){
+               closeLexer(&ctx->archives[k].lex);
+          }
+          free(ctx->archives[k].pulled);
+     }
+     free(ctx->archives);
+     ctx->archives = NULL;
+}
+
+//Runs after pass 1 defined the input's modules. A use the symbol table does not define, of an input
+//module or of a module pulled before, is looked up in the archives in order and the first archived
+//module defining it is appended and defined like an input module, so its own uses are looked at in
+//turn. Only those modules are copied out of the archives, a name none defines is left to rule 3.
+void pullArchiveModules(LinkContext* ctx){
+     Program* prog = ctx->program;
+     Program* owned;
+     ModuleIR* last;
+     Archive* ar;
+     PassOne st;
+     const char* name;
+     unsigned int hash;
+     int u, i, k, sym;
+
+     openArchives(ctx);
+     if (prog->mapped){ //An object input, its lists are not ours to append to
+          owned = createProgram();
+          for (i=0; i<prog->modCount; i++){
+               copyModuleToProgram(owned, prog, &prog->modules[i]);
+          }
+          deallocProgram(prog);
+          ctx->program = prog = owned;
+     }
+     st.baseAddr = 0;
+     st.moduleId = 1;
+     st.totalInstr = 0;
+     st.outIndex = 0;
+     for (i=0; i<prog->modCount; i++){
+          st.totalInstr += prog->modules[i].length;
+     }
+     if (prog->modCount > 0){ //Going on from the input's last module
+          last = &prog->modules[prog->modCount-1];
+          st.baseAddr = last->mod.baseAddr + last->length;
+          st.moduleId = last->mod.id + 1;
+          st.outIndex = last->mod.outIndex + last->instrCount;
+     }
+
+     for (u = 0; u<prog->useCount; u++){ //Uses of pulled modules are appended as they are pulled
+          name = prog->strings + prog->uses[u];
+          hash = hashString(name);
+          if (findSymbolHashed(ctx->symTable, name, hash) != -1){
+               continue;
+          }
+          for (k = 0, sym = -1; k<ctx->archiveCount && (sym = findArchiveSymbol(&ctx->archives[k], name, hash)) == -1; k++);
+          if (sym == -1){
+               continue;
+          }
+          ar = &ctx->archives[k];
+          i = ar->symbols[sym].module;
+          if (ar->pulled[i]){
+               continue;
+          }
+          ar->pulled[i] = 1;
+          if (ar->prog.modules[i].length > instrBudget(ctx, st.totalInstr)){
+               failLink(ctx, LINK_BAD_OBJECT, "Modules pulled from the archives do not fit the machine: %s.", ar->path);
+          }
+          checkObjectModule(ctx, &st, &ar->prog.modules[i], ar->path);
+          copyModuleToProgram(prog, &ar->prog, &ar->prog.modules[i]);
+          defineModule(ctx, &st, prog, &prog->modules[prog->modCount-1]);
+     }
+}
+
+int findArchiveSymbol(Archive* ar, const char* name, unsigned int hash){
+     int slot, i;
+     for (slot = hash & (ar->hashCap - 1); (i = ar->slots[slot]) != -1; slot = (slot + 1) & (ar->hashCap - 1)){
+          if (ar->symbols[i].hash == hash && strcmp(ar->prog.strings + ar->symbols[i].name, name) == 0){
+               return i;
+          }
+     }
+     return -1;
+}
+
+void convertToObject(LinkContext* ctx, InputFile* files, int count, const char* filename){
+     Program* src;
+     Program* dst;
+     ArchiveHeader a; //Only obj is written for an object file
+     ObjHeader* h = &a.obj;
+     ModuleIR* m;
+     ModuleIR* d;
+     int* index; //Interning hash index over dst strings, -1 = empty
+     ArchiveSymbol* syms = NULL; //Archive symbol section
+     int* slots = NULL; //Archive hash section
+     int indexCap, i, j, k, fd, totalInstr, ok, slot, sym;
+     long start;
+     SectionList out;
+
+     if (ctx->large){ //Object words are classic ints
+          failLink(ctx, LINK_BAD_OBJECT, "Object files only hold classic mode modules: %s.", filename);
+     }
+     //Parsing with the same checks as pass 1, but nothing is defined or printed
+     src = ctx->program;
+     totalInstr = 0;
+     for (k = 0; k<count; k++){ //Modules of all inputs back to back, as they would be linked
+          //Archived modules are linked a few at a time, each only has to fit the machine on its own
+          while (parseModule(&files[k].lex, src, instrBudget(ctx, ctx->archive ? 0 : totalInstr), LONG_MAX, &start) == 1){
+               totalInstr += src->modules[src->modCount-1].length;
+          }
+     }
+
+     //Copying into dst with each symbol name stored once
+     dst = createProgram();
+     indexCap = 64;
+     while (indexCap < 2*(src->defCount + src->useCount)){
+          indexCap *= 2;
+     }
+     index = (int*)malloc(indexCap * sizeof(int));
+     if (index == NULL){
+          fprintf(stderr, "convertToObject:index Failed to allocate memory.\n");
+          exit(-1);
+     }
+     memset(index, -1, indexCap * sizeof(int));
+     for (i=0; i<src->modCount; i++){
+          m = &src->modules[i];
+          d = addModuleToProgram(dst, m->mod);
+          d->length = m->length;
+          d->instrStart = m->instrStart; //Instruction sections are written straight from src
+          d->instrCount = m->instrCount;
+          for (j=0; j<m->defCount; j++){
+               if (dst->defCount == dst->defCap){
+                    dst->defs = growArray(dst->defs, &dst->defCap, sizeof(Def), "convertToObject:defs");
+               }
+               dst->defs[dst->defCount].sym = internString(dst, index, indexCap, src->strings + src->defs[m->defStart + j].sym);
+               dst->defs[dst->defCount].relAddr = src->defs[m->defStart + j].relAddr;
+               dst->defCount += 1;
+               d->defCount += 1;
+          }
+          for (j=0; j<m->useCount; j++){
+               if (dst->useCount == dst->useCap){
+                    dst->uses = growArray(dst->uses, &dst->useCap, sizeof(int), "convertToObject:uses");
+               }
+               dst->uses[dst->useCount] = internString(dst, index, indexCap, src->strings + src->uses[m->useStart + j]);
+               dst->useCount += 1;
+               d->useCount += 1;
+          }
+     }
+     if (dst->strSize == 0){ //Keeping the string section non empty
+          addStringToProgram(dst, "", 0);
+     }
+
+     //Header, then sections back to back with padding to OBJ_ALIGN
+     memset(&a, 0, sizeof(a));
+     memcpy(h->magic, ctx->archive ? ARCHIVE_MAGIC : OBJ_MAGIC, 8);
+     h->totalInstr = totalInstr;
+     h->moduleCount = dst->modCount;
+     h->defCount = dst->defCount;
+     h->useCount = dst->useCount;
+     h->instrCount = src->instrCount;
+     h->strSize = dst->strSize;
+     out.count = 0;
+     out.off = 0;
+     addSection(&out, NULL, &a, ctx->archive ? sizeof(ArchiveHeader) : sizeof(ObjHeader));
+     addSection(&out, &h->moduleOff, dst->modules, (size_t)dst->modCount * sizeof(ModuleIR));
+     addSection(&out, &h->defOff, dst->defs, (size_t)dst->defCount * sizeof(Def));
+     addSection(&out, &h->useOff, dst->uses, (size_t)dst->useCount * sizeof(int));
+     addSection(&out, &h->modeOff, src->modes, (size_t)src->instrCount);
+     addSection(&out, &h->wordOff, src->words, (size_t)src->instrCount * sizeof(int));
+     addSection(&out, &h->strOff, dst->strings, (size_t)dst->strSize);
+
+     if (ctx->archive){ //Every name once, names are interned so equal names have equal offsets
+          for (a.hashCap = 8; a.hashCap < 2*dst->defCount; a.hashCap *= 2);
+          syms = (ArchiveSymbol*)malloc((dst->defCount > 0 ? dst->defCount : 1) * sizeof(ArchiveSymbol));
+          slots = (int*)malloc(a.hashCap * sizeof(int));
+          __atomic_add_fetch(&heapAllocs, 2, __ATOMIC_RELAXED);
+          if (syms == NULL || slots == NULL){
+               fprintf(stderr, "convertToObject:syms Failed to allocate memory.\n");
+               exit(-1);
+          }
+          memset(slots, -1, a.hashCap * sizeof(int));
+          for (i=0; i<dst->modCount; i++){
+               d = &dst->modules[i];
+               for (j=0; j<d->defCount; j++){
+                    sym = dst->defs[d->defStart + j].sym;
+                    syms[a.symbolCount].hash = hashString(dst->strings + sym);
+                    for (slot = syms[a.symbolCount].hash & (a.hashCap - 1); slots[slot] != -1 && syms[slots[slot]].name != sym; slot = (slot + 1) & (a.hashCap - 1));
+                    if (slots[slot] == -1){ //Defined first here
+                         syms[a.symbolCount].name = sym;
+                         syms[a.symbolCount].module = i;
+                         slots[slot] = a.symbolCount++;
+                    }
+               }
+          }
+          addSection(&out, &a.symbolOff, syms, (size_t)a.symbolCount * sizeof(ArchiveSymbol));
+          addSection(&out, &a.hashOff, slots, (size_t)a.hashCap * sizeof(int));
+     }
+
+     fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+     ok = fd >= 0 && writevAll(fd, out.iov, out.count) == 0;
+     ok = (fd < 0 || close(fd) == 0) && ok;
+     free(index);
+     free(syms);
+     free(slots);
+     deallocProgram(dst);
+     if (!ok){
+          failLink(ctx, LINK_IO_ERROR, "Cannot write file: %s.", filename);
+     }
+}
+
+void addSection(SectionList* out, long long* field, const void* bytes, size_t size){
+     static char pad[OBJ_ALIGN]; //Zeros between sections
+     if (field != NULL){
+          *field = out->off;
+     }
+     out->iov[out->count].iov_base = (void*)bytes;
+     out->iov[out->count++].iov_len = size;
+     out->off += size;
+     if (out->off % OBJ_ALIGN){
+          out->iov[out->count].iov_base = pad;
+          out->iov[out->count++].iov_len = OBJ_ALIGN - out->off % OBJ_ALIGN;
+          out->off += OBJ_ALIGN - out->off % OBJ_ALIGN;
+     }
+}
+
+//Sizes the image from pass 1, words at addresses 0 up to the end of the highest module, and maps
+//it up to the diag section, whose size is only known after pass 2. Unwritten words stay 0.
+void openImage(LinkContext* ctx){
+     SymbolTable* st = ctx->symTable;
+     ImageHeader h;
+     ModuleIR* m;
+     int i, end;
+
+     memset(&h, 0, sizeof(h));
+     ctx->imageWords = 0;
+     for (i=0; i<ctx->program->modCount; i++){
+          m = &ctx->program->modules[i];
+          end = m->mod.baseAddr + m->instrCount;
+          if (end > ctx->imageWords){
+               ctx->imageWords = end;
+          }
+     }
+     h.wordOff = (sizeof(ImageHeader) + OBJ_ALIGN - 1) / OBJ_ALIGN * OBJ_ALIGN;
+     h.symbolOff = h.wordOff + ((long long)ctx->imageWords * sizeof(int) + OBJ_ALIGN - 1) / OBJ_ALIGN * OBJ_ALIGN;
+     h.strOff = h.symbolOff + (long long)st->size * sizeof(ImageSymbol);
+     h.diagOff = h.strOff + (st->namesSize + ctx->program->strSize + OBJ_ALIGN - 1) / OBJ_ALIGN * OBJ_ALIGN;
+
+     ctx->imageFd = open(ctx->imagePath, O_RDWR|O_CREAT|O_TRUNC, 0644);
+     if (ctx->imageFd < 0 || ftruncate(ctx->imageFd, h.diagOff) != 0){
+          failLink(ctx, LINK_IO_ERROR, "Cannot write file: %s.", ctx->imagePath);
+     }
+     ctx->imageMap = (char*)mmap(NULL, h.diagOff, PROT_READ|PROT_WRITE, MAP_SHARED, ctx->imageFd, 0);
+     if (ctx->imageMap == MAP_FAILED){
+          ctx->imageMap = NULL;
+          failLink(ctx, LINK_IO_ERROR, "Cannot write file: %s.", ctx->imagePath);
+     }
+     ctx->imageMapSize = h.diagOff;
+     memcpy(ctx->imageMap, &h, sizeof(h)); //Offsets for closeImage, magic and counts stay zero until then
+     ctx->image = (int*)(ctx->imageMap + h.wordOff);
 
-          rule5Violation(defCount,moduleSize); //Check for rule 5 violations
-          currentModule += 1; //Updating module number
-          currentBaseAddr += moduleSize; //Update base addr for next module
-     } 
+     for (i=0; i<st->size; i++){ //Where the text prints the symbol table
+          if (BIT_TEST(st->definedAlready, i)){
+               addDiag(&ctx->diags, 2, -1, st->modId[i], st->nameAt[i]);
+          }
+     }
 }
 
-void passTwo() {
-     int defCount, useCount, moduleSize, i, currentBaseAddr, currentModule, instCount;
-     SymbolTable* useList; //Holds symbols in use list
-     Module mod; //holds module info
+//Symbols are written last as rule 4 marks are only final after pass 2, then the diags go after the
+//mapping. The magic goes in last so a reader never takes a half written image for a whole one.
+void closeImage(LinkContext* ctx){
+     SymbolTable* st = ctx->symTable;
+     ImageHeader h;
+     ImageSymbol* sym;
+     struct iovec iov;
+     int i, ok;
 
-     instCount = 0; //Instruction counter for printing memory table
-     currentBaseAddr = 0; //Base addr starts from 0
-     currentModule = 1; //Module number starts from 1
-     printSymbolTable(mySymTable); //Starting the printing process
+     memcpy(&h, ctx->imageMap, sizeof(h));
+     h.wordCount = ctx->imageWords;
+     h.symbolCount = st->size;
+     h.diagCount = ctx->diags.size / sizeof(ImageDiag);
+     h.strSize = st->namesSize + ctx->program->strSize;
+     sym = (ImageSymbol*)(ctx->imageMap + h.symbolOff);
+     for (i=0; i<st->size; i++){
+          sym[i].name = st->nameAt[i];
+          sym[i].absAddr = st->absAddr[i];
+          sym[i].module = st->modId[i];
+          sym[i].flags = (BIT_TEST(st->definedAlready, i) ? IMAGE_SYM_MULTIPLE : 0) | (BIT_TEST(st->used, i) ? IMAGE_SYM_USED : 0);
+     }
+     if (st->namesSize > 0){ //Defined names, then every name the input had, either pool may be empty and NULL
+          memcpy(ctx->imageMap + h.strOff, st->names, st->namesSize);
+     }
+     if (ctx->program->strSize > 0){
+          memcpy(ctx->imageMap + h.strOff + st->namesSize, ctx->program->strings, ctx->program->strSize);
+     }
+     memcpy(h.magic, IMAGE_MAGIC, 8);
+     memcpy(ctx->imageMap, &h, sizeof(h));
 
-     while (1){
-          //Module init
-          mod.baseAddr = currentBaseAddr;
-          mod.id = currentModule;  
+     ok = munmap(ctx->imageMap, ctx->imageMapSize) == 0;
+     ctx->imageMap = NULL;
+     ctx->image = NULL;
+     iov.iov_base = ctx->diags.data;
+     iov.iov_len = ctx->diags.size;
+     ok = lseek(ctx->imageFd, h.diagOff, SEEK_SET) == h.diagOff && writevAll(ctx->imageFd, &iov, 1) == 0 && ok;
+     ok = close(ctx->imageFd) == 0 && ok;
+     ctx->imageFd = -1;
+     if (!ok){
+          failLink(ctx, LINK_IO_ERROR, "Cannot write file: %s.", ctx->imagePath);
+     }
+}
 
-          //Reading defList
-          defCount = readInt();
-          if(defCount == -1) {
-               break; //EoF
-          }
-          for (i=0; i<defCount; i++) {
-               readSym();
-               readInt();
-               //Discarding return values
-               //Feels like nothing to do here for pass 2
-          }
+//Written after pass 2, when rule 4 marks are final. Symbols are sorted by address for
+//addr to symbol lookups, modules by base for addr to module lookups, and the hash section finds
+//a name without sorting by it. Names are the symbol table's string pool as is.
+void writeSymbolIndex(LinkContext* ctx){
+     SymbolTable* st = ctx->symTable;
+     Program* prog = ctx->program;
+     IndexHeader h;
+     IndexSymbol* syms;
+     IndexModule* mods;
+     int* slots;
+     int i, slot, fd, ok;
+     SectionList out;
 
-          //Reading useList
-          useList = createSymbolTable(); //use list init
-          useCount = readInt();
-          for (i=0; i<useCount; i++){
-               char* symToken;
-               Symbol* symbol;
-               symToken = readSym(); //getToken
-               symbol = createSymbol(symToken, mod); //Make symbol
-               addSymbolToTable(useList,symbol); //Add it to use list
-          }
+     memset(&h, 0, sizeof(h));
+     memcpy(h.magic, INDEX_MAGIC, 8);
+     h.symbolCount = st->size;
+     h.moduleCount = prog->modCount;
+     h.strSize = st->namesSize;
+     for (h.hashCap = 8; h.hashCap < 2*st->size; h.hashCap *= 2);
+     syms = (IndexSymbol*)malloc((st->size > 0 ? st->size : 1) * sizeof(IndexSymbol));
+     mods = (IndexModule*)malloc((prog->modCount > 0 ? prog->modCount : 1) * sizeof(IndexModule));
+     slots = (int*)malloc(h.hashCap * sizeof(int));
+     __atomic_add_fetch(&heapAllocs, 3, __ATOMIC_RELAXED);
+     if (syms == NULL || mods == NULL || slots == NULL){
+          fprintf(stderr, "writeSymbolIndex:syms Failed to allocate memory.\n");
+          exit(-1);
+     }
+     for (i=0; i<st->size; i++){
+          syms[i].absAddr = st->absAddr[i];
+          syms[i].module = st->modId[i];
+          syms[i].name = st->nameAt[i];
+          syms[i].hash = st->hashes[i];
+          syms[i].flags = (BIT_TEST(st->definedAlready, i) ? INDEX_SYM_MULTIPLE : 0) | (BIT_TEST(st->used, i) ? INDEX_SYM_USED : 0);
+     }
+     qsort(syms, st->size, sizeof(IndexSymbol), compareIndexSymbols);
+     for (i=0; i<prog->modCount; i++){
+          mods[i].id = prog->modules[i].mod.id;
+          mods[i].baseAddr = prog->modules[i].mod.baseAddr;
+          mods[i].size = prog->modules[i].instrCount;
+     }
+     qsort(mods, prog->modCount, sizeof(IndexModule), compareIndexModules);
+     memset(slots, -1, h.hashCap * sizeof(int));
+     for (i=0; i<st->size; i++){ //Names are unique in the symbol table, no compares needed
+          for (slot = syms[i].hash & (h.hashCap - 1); slots[slot] != -1; slot = (slot + 1) & (h.hashCap - 1));
+          slots[slot] = i;
+     }
 
-          //Reading program text
-          moduleSize = readInt(); //module length
-          for (i=0; i<moduleSize; i++){
-               char addressMode;
-               int op, opcode, operand, errcode;
-               char* errsym;
-               
-               addressMode = readIEAR(); //"I E A R"
-               op = readInt(); //Instruction
-               opcode = op/1000; //Op code
-               operand = op%1000; //Operand
-               errcode = -1; //Error code for errors
-               errsym = NULL; //Symbol for errors
-
-               switch (addressMode)
-               {
-               case 'I':
-                    //Rule 10 violated?
-                    if (op >= 10000) { //Illegal I instruction
-                         op = 9999; //Settings it to 9999
-                         opcode = op/1000;
-                         operand = op%1000;
-                         errcode = 10; //Rule 10 broken
-                    }
-                    break;
-               case 'E':
-                    //Is rule 11 violated?
-                    if (opcode >= 10) { //Checking for valid instruction
-                         op = 9999;
-                         opcode = op/1000;
-                         operand = op%1000;
-                         errcode = 11; //Rule 11 broken
-                         break;
-                    }
-                    //Rule 6 violated?
-                    //operand = index of symbol in uselist
-                    if (operand >= useList->size){ //Out of bound access into useList
-                         errcode = 6; //Rules 6 broken
-                         break;
-                    }
+     out.count = 0;
+     out.off = 0;
+     addSection(&out, NULL, &h, sizeof(h));
+     addSection(&out, &h.symbolOff, syms, (size_t)st->size * sizeof(IndexSymbol));
+     addSection(&out, &h.moduleOff, mods, (size_t)prog->modCount * sizeof(IndexModule));
+     addSection(&out, &h.hashOff, slots, (size_t)h.hashCap * sizeof(int));
+     addSection(&out, &h.strOff, st->names, (size_t)st->namesSize);
 
-                    //Rule 3 violated?
-                    Symbol* ulSymbol = useList->symbolList[operand]; //Get the use symbol
-                    Symbol* stSymbol = findSymbolInTable(mySymTable,ulSymbol->sym); //Finding the use symbol in def list
-                    if (stSymbol == NULL){ //Using a symbol not in def list
-                         operand = 0; //Using abs zero
-                         ulSymbol->used = 1; //Setting the symbol to used
-                         errcode = 3; //Rule 3 broken
-                         errsym = ulSymbol->sym;
-                    } else{ //Using a symbol in def list
-                         stSymbol->used = 1; //stSymbol used
-                         ulSymbol->used = 1; //ulSymbol used
-                         operand = stSymbol->absAddr; //Update operand to symbol abs addr
-                    }
-                    break;
-               case 'A':
-                    //Is rule 11 violated?
-                    if (opcode >= 10) {
-                         op = 9999;
-                         opcode = op/1000;
-                         operand = op%1000;
-                         errcode = 11;
-                         break;
-                    }
-                    //Rule 8 violated?
-                    if (operand > 512){ //Greater than machine size
-                         operand = 0;
-                         errcode = 8;
-                    }
-                    break;
-               case 'R':
-                    //Is rule 11 violated?
-                    if (opcode >= 10) {
-                         op = 9999;
-                         opcode = op/1000;
-                         operand = op%1000;
-                         errcode = 11;
-                         break;
-                    }
-                    //Rule 9 violated?
-                    //operand holds relative addr
-                    if (operand > moduleSize) { //relative addr > module size?
-                         errcode = 9; //Rule 9 broken
-                         operand = currentBaseAddr; //relative addr = 0, abs addr = base addr
-                    } else{
-                         operand += currentBaseAddr; //Adding base addr to relative addr
-                    }
-                    break;
-               }
-               op = opcode*1000 + operand; //Calculating new addr
-               printf("%03d: %04d ",instCount, op);
-               if (errcode != -1){ //There is an error, print the error message
-                    __nonTerminatingError(errcode, errsym);
-               } else{ //No error, printing a new line
-                    printf("\n");
-               }
-               instCount += 1; //Updating instr counter
-          }
-          rule7Violation(useList); //Checking for rule 7 violation
-          deallocSymbolTable(useList); //Destorying the use list for this module
-          currentModule += 1; //Updating module number
-          currentBaseAddr += moduleSize; //Update base addr for next module
+     fd = open(ctx->indexPath, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+     ok = fd >= 0 && writevAll(fd, out.iov, out.count) == 0;
+     ok = (fd < 0 || close(fd) == 0) && ok;
+     free(syms);
+     free(mods);
+     free(slots);
+     if (!ok){
+          failLink(ctx, LINK_IO_ERROR, "Cannot write file: %s.", ctx->indexPath);
      }
-     rule4Violation(); //Checking for rule 4 violation
 }
 
-void initGlobalVar(const char* filename) {
-     fptr = fopen(filename,"r");
-     if (fptr == NULL) {
-          fprintf(stderr, "Cannot open file: %s.\n", filename);
-          exit(-1);
+int compareIndexSymbols(const void* a, const void* b){
+     const IndexSymbol* x = (const IndexSymbol*)a;
+     const IndexSymbol* y = (const IndexSymbol*)b;
+     if (x->absAddr != y->absAddr){
+          return x->absAddr < y->absAddr ? -1 : 1;
      }
-     linenum = 0;
-     lineoffset = 0;
+     return x->name < y->name ? -1 : x->name > y->name; //Names are pooled in definition order
 }
 
-Symbol* createSymbol(char* token, Module m){
-     Symbol* s = (Symbol*)malloc(sizeof(Symbol));
-     if (s == NULL){ //Error checking
-          fprintf(stderr, "createSymbol:s Failed to allocate memory.\n");
-          exit(-1);
+int compareIndexModules(const void* a, const void* b){
+     const IndexModule* x = (const IndexModule*)a;
+     const IndexModule* y = (const IndexModule*)b;
+     if (x->baseAddr != y->baseAddr){
+          return x->baseAddr < y->baseAddr ? -1 : 1;
      }
-     s->sym = (char*)malloc(17*sizeof(char)); //Max 16 characters + 1 null char
-     if (s == NULL){
-          fprintf(stderr, "createSymbol:sym Failed to allocate memory.\n");
-          exit(-1);
+     return x->id < y->id ? -1 : x->id > y->id;
+}
+
+void addDiag(OutBuf* out, int rule, int addr, int module, int name){
+     ImageDiag d;
+     d.rule = rule;
+     d.addr = addr;
+     d.module = module;
+     d.name = name;
+     outBytes(out, (const char*)&d, sizeof(d));
+}
+
+//Adds str to p's string pool unless it is there already, returns its offset.
+//index is an open addressing table of pool offsets, big enough to never fill up.
+int internString(Program* p, int* index, int indexCap, const char* str){
+     int slot, mask;
+     mask = indexCap - 1;
+     for (slot = hashString(str) & mask; index[slot] != -1; slot = (slot + 1) & mask){
+          if (strcmp(p->strings + index[slot], str) == 0){
+               return index[slot];
+          }
      }
-     strcpy(s->sym,token);
-     s->definedAlready = 0;
-     s->absAddr = 0;
-     s->relAddr = 0;
-     s->used = 0;
-     s->mod.baseAddr = m.baseAddr;
-     s->mod.id = m.id;
-     return s;
+     index[slot] = addStringToProgram(p, str, strlen(str));
+     return index[slot];
 }
 
-void deallocSymbol(Symbol* s) {
-     free(s->sym);
-     free(s);
+void printSymbol(OutBuf* out, SymbolTable* st, int i){
+     outStr(out, SYM_NAME(st, i)); //"%s=%d "
+     outBytes(out, "=", 1);
+     outInt(out, st->absAddr[i], 0);
+     outBytes(out, " ", 1);
+     if (BIT_TEST(st->definedAlready, i)){ //Rule 2 violation, already defined
+          __nonTerminatingError(out,2,NULL);
+     }
+     outBytes(out, "\n", 1);
 }
 
-void printSymbol(Symbol* s){
-     printf("%s=%d ",s->sym, s->absAddr);
-     if (s->definedAlready == 1){ //Rule 2 violation, already defined
-          __nonTerminatingError(2,NULL);
+SymbolTable* createSymbolTable(Arena* a, int expected, LinkStats* stats){
+     SymbolTable* st;
+     if (a != NULL){
+          st = (SymbolTable*)arenaAlloc(a, sizeof(SymbolTable));
+     } else{
+          st = (SymbolTable*)malloc(sizeof(SymbolTable));
+          __atomic_add_fetch(&heapAllocs, 1, __ATOMIC_RELAXED);
+          if (st == NULL){
+               fprintf(stderr, "createSymbolTable:st Failed to allocate memory.\n");
+               exit(-1);
+          }
      }
-     printf("\n");
+#ifdef LINK_STATS
+     if (stats != NULL){
+          __atomic_add_fetch(&stats->tableAllocs, 1, __ATOMIC_RELAXED);
+     }
+#endif
+     memset(st, 0, sizeof(SymbolTable)); //Arrays start NULL, growSymbolTable allocates them
+     st->stats = stats;
+     st->arena = a;
+     growSymbolTable(st, expected > 2 ? expected + 1 : 2); //One spare, tables grow when they fill up
+     st->namesCap = st->cap * 8; //Room for short names, the pool grows as needed
+     st->names = (char*)tableRealloc(st, NULL, 0, st->namesCap, "createSymbolTable:names");
+     for (st->hashCap = 4; st->hashCap < st->cap*2; st->hashCap *= 2); //Twice the array cap
+     st->hashSlots = (int*)tableRealloc(st, NULL, 0, st->hashCap*sizeof(int), "createSymbolTable:hashSlots");
+     memset(st->hashSlots, -1, st->hashCap*sizeof(int)); //All slots empty
+     return st;
 }
 
-SymbolTable* createSymbolTable(){
-     SymbolTable* st = (SymbolTable*)malloc(sizeof(SymbolTable));
-     if (st == NULL){
-          fprintf(stderr, "createSymbolTable:st Failed to allocate memory.\n");
-          exit(-1);
+void* tableRealloc(SymbolTable* st, void* old, size_t oldSize, size_t newSize, const char* who){
+     void* p;
+     if (st->arena != NULL){ //Old array is left in the arena, it goes away on reset
+          p = arenaAlloc(st->arena, newSize);
+          if (old != NULL){
+               memcpy(p, old, oldSize);
+          }
+          return p;
      }
-     st->cap = 2; //starting cap
-     st->size = 0; //empty start
-     st->symbolList = (Symbol**)malloc(st->cap*sizeof(Symbol*));
-     if (st->symbolList == NULL){
-          fprintf(stderr, "createSymbolTable:symbolList Failed to allocate memory.\n");
+     p = realloc(old, newSize);
+     __atomic_add_fetch(&heapAllocs, 1, __ATOMIC_RELAXED);
+     if (p == NULL){
+          fprintf(stderr, "%s Failed to allocate memory.\n", who);
           exit(-1);
      }
-     return st;
+     return p;
+}
+
+void growSymbolTable(SymbolTable* st, int cap){
+     int n = st->size; //Entries to keep
+     int bits = st->cap / 8 + 1; //Bitset bytes to keep, 0 before the first grow
+     if (st->used == NULL){
+          bits = 0;
+     }
+     st->nameAt = (int*)tableRealloc(st, st->nameAt, n*sizeof(int), cap*sizeof(int), "growSymbolTable:nameAt");
+     st->hashes = (unsigned int*)tableRealloc(st, st->hashes, n*sizeof(unsigned int), cap*sizeof(unsigned int), "growSymbolTable:hashes");
+     st->absAddr = (int*)tableRealloc(st, st->absAddr, n*sizeof(int), cap*sizeof(int), "growSymbolTable:absAddr");
+     st->relAddr = (int*)tableRealloc(st, st->relAddr, n*sizeof(int), cap*sizeof(int), "growSymbolTable:relAddr");
+     st->modId = (int*)tableRealloc(st, st->modId, n*sizeof(int), cap*sizeof(int), "growSymbolTable:modId");
+     st->modBase = (int*)tableRealloc(st, st->modBase, n*sizeof(int), cap*sizeof(int), "growSymbolTable:modBase");
+     st->used = (unsigned char*)tableRealloc(st, st->used, bits, cap / 8 + 1, "growSymbolTable:used");
+     st->definedAlready = (unsigned char*)tableRealloc(st, st->definedAlready, bits, cap / 8 + 1, "growSymbolTable:definedAlready");
+     memset(st->used + bits, 0, cap / 8 + 1 - bits); //New bits start clear
+     memset(st->definedAlready + bits, 0, cap / 8 + 1 - bits);
+     st->cap = cap;
 }
 
 void deallocSymbolTable(SymbolTable* st){
-     int i;
-     for (i = 0; i<st->size; i++){
-          deallocSymbol(st->symbolList[i]);
+     if (st->arena != NULL){ //Nothing to free, the arena owns it all
+          return;
      }
-     free(st->symbolList);
+     free(st->names);
+     free(st->nameAt);
+     free(st->hashes);
+     free(st->absAddr);
+     free(st->relAddr);
+     free(st->modId);
+     free(st->modBase);
+     free(st->used);
+     free(st->definedAlready);
+     free(st->hashSlots);
      free(st);
 }
 
-void printSymbolTable(SymbolTable* st){
+void printSymbolTable(OutBuf* out, SymbolTable* st){
      int i;
-     printf("Symbol Table\n");
+     outStr(out, "Symbol Table\n");
      for (i = 0; i<st->size; i++){
-          printSymbol(st->symbolList[i]);
+          printSymbol(out, st, i);
      }
-     printf("\nMemory Map\n");
+     outStr(out, "\nMemory Map\n");
 }
 
-void printSymbolTableSyms(SymbolTable* st){
+void printSymbolTableSyms(OutBuf* out, SymbolTable* st){
      int i;
-     printf("Symbol in use list ---\n");
+     outStr(out, "Symbol in use list ---\n");
      for (i = 0; i<st->size; i++){
-          printSymbol(st->symbolList[i]);
+          printSymbol(out, st, i);
      }
 }
 
-Symbol* findSymbolInTable(SymbolTable* st, char* token){
-     int i;
-     Symbol* s;
-     for (i = 0; i<st->size; i++){
-          s = st->symbolList[i];
-          if (strcmp(s->sym,token)==0){ //Found a match
-               return s;
+unsigned int hashString(const char* str){
+     unsigned int h = 2166136261u; //FNV offset basis
+     while (*str != '\0'){
+          h ^= (unsigned char)*str++;
+          h *= 16777619u; //FNV prime
+     }
+     return h;
+}
+
+int findSymbolInTable(SymbolTable* st, const char* token){
+     return findSymbolHashed(st, token, hashString(token));
+}
+
+int findSymbolHashed(SymbolTable* st, const char* token, unsigned int hash){
+     int slot, mask, probes, i;
+     mask = st->hashCap - 1;
+     probes = 0;
+     for (slot = hash & mask; (i = st->hashSlots[slot]) != -1; slot = (slot + 1) & mask){ //Linear probing
+          probes += 1;
+          if (st->hashes[i] == hash && strcmp(SYM_NAME(st, i),token)==0){ //Found a match
+               break;
           }
      }
-     return NULL; //Not Found
+#ifdef LINK_STATS
+     if (st->stats != NULL){ //Atomic since relocation threads count too
+          __atomic_add_fetch(&st->stats->lookups, 1, __ATOMIC_RELAXED);
+          __atomic_add_fetch(&st->stats->compares, probes, __ATOMIC_RELAXED);
+     }
+#endif
+     return i; //-1 when Not Found
 }
 
-void addSymbolToTable(SymbolTable* st, Symbol* s){
+void growSymbolTableIndex(SymbolTable* st){
+     int i, slot, mask;
+     if (st->arena == NULL){
+          free(st->hashSlots);
+     }
+     st->hashCap *= 2; //Doubling capacity
+     st->hashSlots = (int*)tableRealloc(st, NULL, 0, st->hashCap*sizeof(int), "growSymbolTableIndex:hashSlots");
+     memset(st->hashSlots, -1, st->hashCap*sizeof(int));
+     mask = st->hashCap - 1;
+     for (i = 0; i<st->size; i++){ //Reinsert using the stored hashes
+          for (slot = st->hashes[i] & mask; st->hashSlots[slot] != -1; slot = (slot + 1) & mask);
+          st->hashSlots[slot] = i;
+     }
+}
+
+int addSymbolToTable(SymbolTable* st, const char* token, Module m, int relAddr){
      //Check if symbol already in table
      //If yes, mark defined and return
-     Symbol* temp;
-     if ((temp = findSymbolInTable(st,s->sym)) != NULL){
-          temp->definedAlready = 1; //Set to true
-          deallocSymbol(s); //Deleting s
-          return;
-     } 
-     //Else insert it
-     st->symbolList[st->size] = s;
+     unsigned int hash;
+     int i;
+     hash = hashString(token);
+     if ((i = findSymbolHashed(st,token,hash)) != -1){
+          BIT_SET(st->definedAlready, i); //Set to true
+          return -1;
+     }
+     return appendSymbol(st, token, hash, m, relAddr); //Else insert it
+}
+
+int appendSymbol(SymbolTable* st, const char* token, unsigned int hash, Module m, int relAddr){
+     int i, slot, mask, len;
+     //Name goes to the end of the pool
+     len = strlen(token) + 1;
+     if (st->namesSize + len > st->namesCap){
+          while (st->namesSize + len > st->namesCap){
+               st->namesCap *= 2; //Doubling capacity
+          }
+          st->names = (char*)tableRealloc(st, st->names, st->namesSize, st->namesCap, "addSymbolToTable:names");
+     }
+     memcpy(st->names + st->namesSize, token, len);
+     i = st->size;
+     st->nameAt[i] = st->namesSize;
+     st->namesSize += len;
+     st->hashes[i] = hash;
+     st->relAddr[i] = relAddr;
+     st->absAddr[i] = relAddr + m.baseAddr;
+     st->modId[i] = m.id;
+     st->modBase[i] = m.baseAddr;
+     mask = st->hashCap - 1;
+     for (slot = hash & mask; st->hashSlots[slot] != -1; slot = (slot + 1) & mask);
+     st->hashSlots[slot] = i;
      st->size += 1;
+     if (st->size*2 > st->hashCap){ //Keep load factor at or below 1/2
+          growSymbolTableIndex(st);
+     }
      if (st->size == st->cap){
-          st->cap *= 2; //Doubling capacity
-          st->symbolList = realloc(st->symbolList,st->cap*sizeof(Symbol*));
-          if (st->symbolList == NULL){
-               fprintf(stderr, "addSymbolToTable:symbolList Failed to allocate memory.\n");
-               exit(-1);
+          growSymbolTable(st, st->cap * 2); //Doubling capacity
+     }
+     return i;
+}
+
+int readInt(Lexer* lx){
+     const char* token;
+     int len;
+
+     token = getToken(lx, &len);
+     if (token == NULL){ //Eof reached
+          return -1;
+     }
+     return parseIntToken(lx, token, len);
+}
+
+int parseIntToken(Lexer* lx, const char* token, int len){
+     int i;
+     unsigned int result;
+
+     //Fast path, up to 9 plain digits cannot overflow and need no sign or blank handling
+     if (len <= 9){
+          result = 0;
+          for (i = 0; i<len && (unsigned char)(token[i] - '0') <= 9; i++){
+               result = result*10 + (token[i] - '0');
+          }
+          if (i == len && len > 0){
+               return (int)result;
           }
      }
+     return (int)parseLongToken(lx, token, len); //Truncated to int like the strtol result was
 }
 
-int readInt(){
-     char* token;
-     char* temp;
-     int result;
+long readLong(Lexer* lx){
+     const char* token;
+     int len;
 
-     token = getToken();
+     token = getToken(lx, &len);
      if (token == NULL){ //Eof reached
           return -1;
      }
-     result = strtol(token, &temp, 10);
-     if (*temp != '\0'){ //Invalid int
-          __parseerror(0);
+     return parseLongToken(lx, token, len);
+}
+
+long parseLongToken(Lexer* lx, const char* token, int len){
+     int i, neg, overflow;
+     unsigned long result, limit;
+
+     //Fast path, up to 18 plain digits cannot overflow and need no sign or blank handling
+     if (len <= 18){
+          result = 0;
+          for (i = 0; i<len && (unsigned char)(token[i] - '0') <= 9; i++){
+               result = result*10 + (token[i] - '0');
+          }
+          if (i == len && len > 0){
+               return (long)result;
+          }
+     }
+     //Same rules as strtol(token, &end, 10) with the whole token consumed
+     i = 0;
+     while (i < len && isspace((unsigned char)token[i])){ //Blanks strtol skips but getToken does not split on
+          i++;
      }
-     return result;
+     neg = 0;
+     if (i < len && (token[i] == '+' || token[i] == '-')){
+          neg = (token[i] == '-');
+          i++;
+     }
+     if (i == len){ //No digits
+          __parseerror(lx,0);
+     }
+     limit = neg ? -(unsigned long)LONG_MIN : (unsigned long)LONG_MAX; //strtol clamps here
+     result = 0;
+     overflow = 0;
+     for (; i<len; i++){
+          if (!isdigit((unsigned char)token[i])){ //Invalid int
+               __parseerror(lx,0);
+          }
+          if (result > (limit - (token[i] - '0')) / 10){
+               overflow = 1;
+          } else{
+               result = result*10 + (token[i] - '0');
+          }
+     }
+     if (overflow){
+          result = limit;
+     }
+     return neg ? -(long)(result - 1) - 1 : (long)result;
 }
 
-char* readSym(){
-     char* sym;
-     int i, len;
+int saturateInt(long value){
+     return value > INT_MAX ? INT_MAX : value < INT_MIN ? INT_MIN : (int)value;
+}
+
+const char* readSym(Lexer* lx, int* len){
+     const char* sym;
+     int i;
      
-     sym = getToken();
+     sym = getToken(lx, len);
      if (sym == NULL) { //EoF reached
-          __parseerror(1);
+          __parseerror(lx,1);
      }
      //Check length
-     len = strlen(sym);
-     if (len > 16){
-          __parseerror(3);
+     if (*len > 16){
+          __parseerror(lx,3);
      }
      //Check [a-Z][a-Z0-9]*
-     if (isalpha(sym[0]) == 0){
-          __parseerror(1);
+     if (isalpha((unsigned char)sym[0]) == 0){
+          __parseerror(lx,1);
      }
-     for (i=1; i<len; i++){
-          if (isalnum(sym[i]) == 0){
-               __parseerror(1);
+     for (i=1; i<*len; i++){
+          if (isalnum((unsigned char)sym[i]) == 0){
+               __parseerror(lx,1);
           }
      }
      return sym;
 }
 
-char readIEAR(){
-     char* token;
+char readIEAR(Lexer* lx){
+     const char* token;
+     int len;
 
-     token = getToken();
+     token = getToken(lx, &len);
      if (token == NULL) { //EoF reached
-          __parseerror(2);
+          __parseerror(lx,2);
      }
-     if (strlen(token) != 1 || 
-     !(strcmp(token,"I") == 0 || strcmp(token,"A") == 0 
-     ||strcmp(token,"E") == 0 || strcmp(token,"R") == 0)) {
-          __parseerror(2);
+     if (len != 1 || !(*token == 'I' || *token == 'A' || *token == 'E' || *token == 'R')) {
+          __parseerror(lx,2);
      }
      return *token; //Deference to return a value copy of token
 }
 
-void rule7Violation(SymbolTable* ul){
+void rule7Violation(LinkContext* ctx, OutBuf* out, SymbolTable* ul, int* names){
      int i;
      for (i=0; i<ul->size; i++){
-          if (ul->symbolList[i]->used == 0){ //In use list but not used
-               __warnings(7,0,ul->symbolList[i]);
+          if (BIT_TEST(ul->used, i)){
+               continue;
+          }
+          if (ctx->imagePath != NULL){ //In use list but not used
+               addDiag(out, 7, -1, ul->modId[i], names[i]);
+          } else{
+               __warnings(out,7,0,ul,i);
           }
      }
 }
 
-void rule5Violation(int indexOffset, int length){ 
+void rule5Violation(LinkContext* ctx, int indexOffset, int length){ 
+     SymbolTable* st = ctx->symTable;
      int i;
-     Symbol* s;
-     for (i = mySymTable->size-indexOffset; i<mySymTable->size; i++){
+     i = st->size-indexOffset;
+     if (i < 0){ //Duplicate defs are not inserted, so the table can be shorter than the def count
+          i = 0;
+     }
+     for (; i<st->size; i++){
           //Checking if rel addr > mod length - 1
-          s = mySymTable->symbolList[i];
-          if (s->relAddr > length-1){
-               __warnings(5,length,s);
-               s->relAddr = 0;
-               s->absAddr = s->mod.baseAddr;
+          if (st->relAddr[i] > length-1){
+               if (ctx->imagePath != NULL){
+                    addDiag(ctx->report, 5, -1, st->modId[i], st->nameAt[i]);
+               } else{
+                    __warnings(ctx->report,5,length,st,i);
+               }
+               st->relAddr[i] = 0;
+               st->absAddr[i] = st->modBase[i];
           }
      }
 }
 
-void rule4Violation(){
+void rule4Violation(LinkContext* ctx){
+     SymbolTable* st = ctx->symTable;
      int i;
-     Symbol* s;
-     for (i = 0; i<mySymTable->size; i++){
-          s = mySymTable->symbolList[i];
-          if (s->used == 0){ //defined but not used
-               __warnings(4,0,s);
+     for (i = 0; i<st->size; i++){
+          if ((i & 7) == 0 && st->used[i >> 3] == 0xff){ //Whole byte used, skip its 8 symbols
+               i += 7;
+               continue;
+          }
+          if (BIT_TEST(st->used, i)){
+               continue;
+          }
+          if (ctx->imagePath != NULL){ //defined but not used
+               addDiag(ctx->report, 4, -1, st->modId[i], st->nameAt[i]);
+          } else{
+               __warnings(ctx->report,4,0,st,i);
           }
      }
 }
 
-//Parse error aborts execution
-void __parseerror(int errcode){
+//Parse error ends the link
+void __parseerror(Lexer* lx, int errcode){
+     OutBuf* out; //Output of the link reading lx
      static char* errstr[] = {
         "NUM_EXPECTED",
         "SYM_EXPECTED",
@@ -558,50 +4273,621 @@ void __parseerror(int errcode){
         "TOO_MANY_USE_IN_MODULE",
         "TOO_MANY_INSTR",
      };
-     printf("Parse Error line %d offset %d: %s\n", linenum, lineoffset, errstr[errcode]);
-     exit(-1);
+     if (lx->onError != NULL){ //Speculative parse, the caller tries elsewhere
+          longjmp(*lx->onError, 1);
+     }
+     out = &lx->ctx->out;
+     outStr(out, "Parse Error ");
+     if (lx->name != NULL){ //Linking several files
+          outStr(out, "file ");
+          outStr(out, lx->name);
+          outStr(out, " ");
+     }
+     outStr(out, "line ");
+     outInt(out, lx->linenum, 0);
+     outStr(out, " offset ");
+     outInt(out, lx->lineoffset, 0);
+     outStr(out, ": ");
+     outStr(out, errstr[errcode]);
+     outStr(out, "\n");
+     failLink(lx->ctx, LINK_PARSE_ERROR, NULL, NULL);
+}
+
+void initOutBuf(OutBuf* out, int fd) {
+     out->fd = fd;
+     out->sink = NULL;
+     out->sinkArg = NULL;
+     out->written = 0;
+     out->failed = 0;
+     out->size = 0;
+     out->cap = 1 << 16;
+     out->data = (char*)malloc(out->cap);
+     if (out->data == NULL){
+          fprintf(stderr, "initOutBuf:data Failed to allocate memory.\n");
+          exit(-1);
+     }
+}
+
+char* outReserve(OutBuf* out, size_t n) {
+     if (out->size + n <= out->cap){ //Fast path, there is room
+          return out->data + out->size;
+     }
+     if (out->fd >= 0 || out->sink != NULL){ //Emptying it beats growing it
+          flushOutBuf(out);
+     }
+     if (out->size + n > out->cap){
+          out->cap = (out->size + n > 2*out->cap) ? out->size + n : 2*out->cap;
+          out->data = (char*)realloc(out->data, out->cap);
+          if (out->data == NULL){
+               fprintf(stderr, "outReserve:data Failed to allocate memory.\n");
+               exit(-1);
+          }
+     }
+     return out->data + out->size;
+}
+
+void outBytes(OutBuf* out, const char* bytes, size_t n) {
+     memcpy(outReserve(out, n), bytes, n);
+     out->size += n;
+}
+
+void outStr(OutBuf* out, const char* str) {
+     outBytes(out, str, strlen(str));
+}
+
+void outInt(OutBuf* out, long long value, int width) {
+     static const char digitPairs[201] = //"00" to "99", two digits per table lookup
+          "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+          "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+          "8081828384858687888990919293949596979899";
+     char tmp[24]; //Digits of the value, filled from the back
+     char* p;
+     char* dst;
+     unsigned long long u;
+     int digits, neg, pad;
+
+     neg = value < 0;
+     u = neg ? 0ull - (unsigned long long)value : (unsigned long long)value;
+     p = tmp + sizeof(tmp);
+     while (u >= 100){
+          p -= 2;
+          memcpy(p, digitPairs + 2*(u % 100), 2);
+          u /= 100;
+     }
+     if (u >= 10){
+          p -= 2;
+          memcpy(p, digitPairs + 2*u, 2);
+     } else{
+          *--p = '0' + u;
+     }
+     digits = tmp + sizeof(tmp) - p;
+     pad = width - digits - neg; //Zeros go after the sign, like printf
+     if (pad < 0){
+          pad = 0;
+     }
+     dst = outReserve(out, neg + pad + digits);
+     if (neg){
+          *dst++ = '-';
+     }
+     memset(dst, '0', pad);
+     memcpy(dst + pad, p, digits);
+     out->size += neg + pad + digits;
+}
+
+void flushOutBuf(OutBuf* out) {
+     struct iovec iov;
+     iov.iov_base = out->data;
+     iov.iov_len = out->size;
+     emitOutput(out, &iov, 1);
+     out->size = 0;
+}
+
+void writeOutBuf(OutBuf* dst, OutBuf* out) {
+     struct iovec iov[2];
+
+     if (out->size <= dst->cap - dst->size || (dst->fd < 0 && dst->sink == NULL)){ //Small modules are copied behind the pending output, all are when dst only buffers
+          outBytes(dst, out->data, out->size);
+          out->size = 0;
+          return;
+     }
+     //Large modules go out with the pending output in one writev, no copy
+     iov[0].iov_base = dst->data;
+     iov[0].iov_len = dst->size;
+     iov[1].iov_base = out->data;
+     iov[1].iov_len = out->size;
+     emitOutput(dst, iov, 2);
+     dst->size = 0;
+     out->size = 0;
+}
+
+void emitOutput(OutBuf* out, struct iovec* iov, int count) {
+     size_t total = 0;
+     int i;
+     if (out->failed){ //Nothing more can be written, dropping the rest
+          return;
+     }
+     for (i = 0; i<count; i++){
+          if (out->sink != NULL && iov[i].iov_len > 0 && out->sink(out->sinkArg, iov[i].iov_base, iov[i].iov_len) != 0){
+               out->failed = 1;
+               return;
+          }
+          total += iov[i].iov_len;
+     }
+     if (out->sink == NULL && writevAll(out->fd, iov, count) < 0){
+          out->failed = 1;
+          return;
+     }
+     out->written += total;
 }
 
-void __nonTerminatingError(int errcode, char* s) {
+int writevAll(int fd, struct iovec* iov, int count){
+     ssize_t n;
+     while (count > 0){
+          n = writev(fd, iov, count);
+          if (n < 0){
+               if (errno == EINTR){
+                    continue;
+               }
+               return -1;
+          }
+          while (count > 0 && (size_t)n >= iov->iov_len){ //Skipping what was written
+               n -= iov->iov_len;
+               iov++;
+               count--;
+          }
+          if (count > 0){
+               iov->iov_base = (char*)iov->iov_base + n;
+               iov->iov_len -= n;
+          }
+     }
+     return 0;
+}
+
+void __nonTerminatingError(OutBuf* out, int errcode, char* s) {
      switch(errcode) { //Code is based on rule number
           case 8:
-               printf("Error: Absolute address exceeds machine size; zero used\n");
+               outStr(out, "Error: Absolute address exceeds machine size; zero used\n");
                break;
           case 9:
-               printf("Error: Relative address exceeds module size; zero used\n");
+               outStr(out, "Error: Relative address exceeds module size; zero used\n");
                break;
           case 6:
-               printf("Error: External address exceeds length of uselist; treated as immediate\n");
+               outStr(out, "Error: External address exceeds length of uselist; treated as immediate\n");
                break;
           case 3:
-               printf("Error: %s is not defined; zero used\n", s);
+               outStr(out, "Error: ");
+               outStr(out, s);
+               outStr(out, " is not defined; zero used\n");
                break;
           case 2:
-               printf("Error: This variable is multiple times defined; first value used\n");
+               outStr(out, "Error: This variable is multiple times defined; first value used\n");
                break;
-          case 10:
-               printf("Error: Illegal immediate value; treated as 9999\n");
+          case 10: //s is the word used in large mode
+               outStr(out, "Error: Illegal immediate value; treated as ");
+               outStr(out, s != NULL ? s : "9999");
+               outStr(out, "\n");
                break;
           case 11:
-               printf("Error: Illegal opcode; treated as 9999\n");
+               outStr(out, "Error: Illegal opcode; treated as ");
+               outStr(out, s != NULL ? s : "9999");
+               outStr(out, "\n");
                break;
           default:
-               printf("\n");
+               outStr(out, "\n");
      }
 }
 
-void __warnings(int errcode, int modLength, Symbol* s){
+void __warnings(OutBuf* out, int errcode, int modLength, SymbolTable* st, int i){
      switch(errcode){ //Code based on rule number
           case 5:
-               printf("Warning: Module %d: %s too big %d (max=%d) assume zero relative\n", s->mod.id, s->sym, s->relAddr, modLength-1);
+               outStr(out, "Warning: Module ");
+               outInt(out, st->modId[i], 0);
+               outStr(out, ": ");
+               outStr(out, SYM_NAME(st, i));
+               outStr(out, " too big ");
+               outInt(out, st->relAddr[i], 0);
+               outStr(out, " (max=");
+               outInt(out, modLength-1, 0);
+               outStr(out, ") assume zero relative\n");
                break;
           case 7:
-               printf("Warning: Module %d: %s appeared in the uselist but was not actually used\n", s->mod.id, s->sym);
+               outStr(out, "Warning: Module ");
+               outInt(out, st->modId[i], 0);
+               outStr(out, ": ");
+               outStr(out, SYM_NAME(st, i));
+               outStr(out, " appeared in the uselist but was not actually used\n");
                break;
           case 4:
-               printf("Warning: Module %d: %s was defined but never used\n", s->mod.id, s->sym);
+               outStr(out, "Warning: Module ");
+               outInt(out, st->modId[i], 0);
+               outStr(out, ": ");
+               outStr(out, SYM_NAME(st, i));
+               outStr(out, " was defined but never used\n");
                break;
           default:
-               printf("\n");
+               outStr(out, "\n");
+     }
+}
+LinkCache* openCache(const char* path){
+     LinkCache* c;
+     CacheHeader* h;
+     ModuleIR* m;
+     CacheEntry* e;
+     struct stat st;
+     void* map;
+     int fd, i, ok;
+
+     c = (LinkCache*)calloc(1, sizeof(LinkCache));
+     __atomic_add_fetch(&heapAllocs, 1, __ATOMIC_RELAXED);
+     if (c == NULL){
+          fprintf(stderr, "openCache:c Failed to allocate memory.\n");
+          exit(-1);
+     }
+     c->prog = createProgram();
+     initOutBuf(&c->newOut, -1);
+     fd = open(path, O_RDONLY);
+     if (fd < 0){
+          return c; //First link, nothing cached yet
+     }
+     if (fstat(fd, &st) == 0 && st.st_size >= (long)sizeof(CacheHeader)){
+          map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+          if (map != MAP_FAILED){
+               c->map = (char*)map;
+               c->mapSize = st.st_size;
+          }
+     }
+     close(fd);
+     if (c->map == NULL){
+          return c;
+     }
+
+     //A cache that does not check out is ignored, this link rewrites it
+     h = (CacheHeader*)c->map;
+     ok = memcmp(h->obj.magic, CACHE_MAGIC, 8) == 0 && mapObject(c->map, c->mapSize, c->prog)
+          && h->entryCount == h->obj.moduleCount && h->depCount == h->obj.useCount
+          && h->entryOff % OBJ_ALIGN == 0 && sectionFits(h->entryOff, h->entryCount, sizeof(CacheEntry), c->mapSize)
+          && h->depOff % OBJ_ALIGN == 0 && sectionFits(h->depOff, h->depCount, sizeof(UseDep), c->mapSize)
+          && sectionFits(h->outOff, h->outSize, 1, c->mapSize);
+     if (ok){
+          c->entryCount = h->entryCount;
+          c->entries = (CacheEntry*)(c->map + h->entryOff);
+          c->deps = (UseDep*)(c->map + h->depOff);
+          c->out = c->map + h->outOff;
+     }
+     for (i=0; ok && i<h->entryCount; i++){
+          m = &c->prog->modules[i];
+          e = &c->entries[i];
+          ok = m->defCount <= 16 && m->useCount <= 16 && m->length <= 512 && m->instrCount == (m->length < 0 ? 0 : m->length)
+               && e->textLen >= 0 && sectionFits(e->outStart, e->outLen, 1, h->outSize);
+     }
+     if (!ok){
+          munmap(c->map, c->mapSize);
+          c->map = NULL;
+          free(c->prog); //Its lists pointed into the mapping
+          c->prog = createProgram();
+          return c;
+     }
+
+     return c;
+}
+
+void closeCache(LinkCache* c){
+     if (c->map != NULL){
+          munmap(c->map, c->mapSize);
+     }
+     deallocProgram(c->prog);
+     free(c->index);
+     free(c->hitOf);
+     free(c->newEntries);
+     free(c->newDeps);
+     free(c->newOut.data);
+     free(c);
+}
+
+void saveCache(LinkContext* ctx){
+     LinkCache* c = ctx->cache;
+     const char* path = ctx->cachePath;
+     CacheHeader h;
+     SectionList out;
+     char* tmp;
+     int fd, ok;
+
+     if (!c->changed && c->map != NULL && ctx->program->modCount == ((CacheHeader*)c->map)->entryCount){
+          return; //Every module came out of the cache where it was, the file is still right
+     }
+     if (ctx->program->strSize == 0){ //Keeping the string section non empty, like the converter
+          addStringToProgram(ctx->program, "", 0);
+     }
+     memset(&h, 0, sizeof(h));
+     memcpy(h.obj.magic, CACHE_MAGIC, 8);
+     h.obj.moduleCount = ctx->program->modCount;
+     h.obj.defCount = ctx->program->defCount;
+     h.obj.useCount = ctx->program->useCount;
+     h.obj.instrCount = ctx->program->instrCount;
+     h.obj.strSize = ctx->program->strSize;
+     h.entryCount = ctx->program->modCount;
+     h.depCount = ctx->program->useCount;
+     h.outSize = c->newOut.size;
+     out.count = 0;
+     out.off = 0;
+     addSection(&out, NULL, &h, sizeof(h));
+     addSection(&out, &h.obj.moduleOff, ctx->program->modules, (size_t)ctx->program->modCount * sizeof(ModuleIR));
+     addSection(&out, &h.obj.defOff, ctx->program->defs, (size_t)ctx->program->defCount * sizeof(Def));
+     addSection(&out, &h.obj.useOff, ctx->program->uses, (size_t)ctx->program->useCount * sizeof(int));
+     addSection(&out, &h.obj.modeOff, ctx->program->modes, (size_t)ctx->program->instrCount);
+     addSection(&out, &h.obj.wordOff, ctx->program->words, (size_t)ctx->program->instrCount * sizeof(int));
+     addSection(&out, &h.obj.strOff, ctx->program->strings, (size_t)ctx->program->strSize);
+     addSection(&out, &h.entryOff, c->newEntries, (size_t)ctx->program->modCount * sizeof(CacheEntry));
+     addSection(&out, &h.depOff, c->newDeps, (size_t)ctx->program->useCount * sizeof(UseDep));
+     addSection(&out, &h.outOff, c->newOut.data, c->newOut.size);
+
+     //Written next to the old cache and renamed over it, a failed write leaves the old one whole
+     tmp = (char*)malloc(strlen(path) + 5);
+     __atomic_add_fetch(&heapAllocs, 1, __ATOMIC_RELAXED);
+     if (tmp == NULL){
+          fprintf(stderr, "saveCache:tmp Failed to allocate memory.\n");
+          exit(-1);
+     }
+     sprintf(tmp, "%s.tmp", path);
+     fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+     ok = fd >= 0 && writevAll(fd, out.iov, out.count) == 0;
+     ok = (fd < 0 || close(fd) == 0) && ok;
+     ok = ok && rename(tmp, path) == 0;
+     free(tmp);
+     if (!ok){
+          failLink(ctx, LINK_IO_ERROR, "Cannot write file: %s.", path);
      }
-}
\ No newline at end of file
+}
+
+//Returns the cached module with the given text, preferring one cached with the same base and number
+//since its output may still be good, -1 when no module had this text
+int findCachedModule(LinkCache* c, unsigned long long hash, int textLen, Module at){
+     CacheEntry* e;
+     int slot;
+     //Fast path, the module is where it was last time
+     if (at.id <= c->entryCount){
+          e = &c->entries[at.id - 1];
+          if (e->hash == hash && e->textLen == textLen && e->baseAddr == at.baseAddr && e->moduleId == at.id){
+               return at.id - 1;
+          }
+     } else if (c->entryCount == 0){
+          return -1;
+     }
+     if (c->index == NULL){
+          indexCache(c);
+     }
+     slot = cacheSlot(c, hash, textLen, at, 0);
+     if (c->index[slot] == -1){
+          slot = cacheSlot(c, hash, textLen, at, 1);
+     }
+     return c->index[slot];
+}
+
+void indexCache(LinkCache* c){
+     Module at; //Where a cached module was
+     int i, any, slot;
+
+     //Each module goes in under its text and place, and under its text alone, unless an equal one is in already
+     c->indexCap = 64;
+     while (c->indexCap < 4*c->entryCount){
+          c->indexCap *= 2;
+     }
+     c->index = (int*)malloc(c->indexCap * sizeof(int));
+     __atomic_add_fetch(&heapAllocs, 1, __ATOMIC_RELAXED);
+     if (c->index == NULL){
+          fprintf(stderr, "indexCache:index Failed to allocate memory.\n");
+          exit(-1);
+     }
+     memset(c->index, -1, c->indexCap * sizeof(int));
+     for (i=0; i<c->entryCount; i++){
+          for (any = 0; any < 2; any++){
+               at.baseAddr = c->entries[i].baseAddr;
+               at.id = c->entries[i].moduleId;
+               at.outIndex = c->entries[i].outIndex;
+               slot = cacheSlot(c, c->entries[i].hash, c->entries[i].textLen, at, any);
+               if (c->index[slot] == -1){
+                    c->index[slot] = i;
+               }
+          }
+     }
+}
+
+//Probes for a module with this text, with the base and number of at unless any is set.
+//Returns the slot of the match, or the empty slot ending the probe.
+int cacheSlot(LinkCache* c, unsigned long long hash, int textLen, Module at, int any){
+     unsigned long long key;
+     CacheEntry* e;
+     int slot, mask;
+     mask = c->indexCap - 1;
+     key = any ? hash : hash ^ ((unsigned long long)(unsigned int)at.baseAddr << 32 | (unsigned int)at.id) * 0x9E3779B97F4A7C15ull; //Spreads one text's places apart
+     for (slot = key & mask; c->index[slot] != -1; slot = (slot + 1) & mask){
+          e = &c->entries[c->index[slot]];
+          if (e->hash == hash && e->textLen == textLen && (any || (e->baseAddr == at.baseAddr && e->moduleId == at.id))){
+               break;
+          }
+     }
+     return slot;
+}
+
+unsigned long long hashBytes(const char* bytes, long n){
+     unsigned long long h = 14695981039346656037ull; //FNV offset basis
+     long i;
+     for (i = 0; i<n; i++){
+          h ^= (unsigned char)bytes[i];
+          h *= 1099511628211ull; //FNV prime
+     }
+     return h;
+}
+
+//Reads past one module counting tokens, the counts are the only tokens looked at.
+//Returns 1 with the module's text in [start, end) of the buffer, 0 on EoF, and -1 when a count
+//is not plain digits in range or the input ends early, the module is then parsed to report it.
+int skimModule(Lexer* lex, long* start, long* end){
+     static const int limits[3] = {16, 16, 512}; //Def, use and instr counts
+     static const int tokensPer[3] = {2, 1, 2}; //Tokens per def, use and instr
+     const char* token;
+     int len, part, n, i;
+
+     token = getToken(lex, &len);
+     if (token == NULL){
+          return 0;
+     }
+     *start = token - lex->buf;
+     for (part = 0; part<3; part++){
+          if (part > 0 && (token = getToken(lex, &len)) == NULL){
+               return -1;
+          }
+          if (len > 3){
+               return -1;
+          }
+          for (n = 0, i = 0; i<len; i++){
+               if (!isdigit((unsigned char)token[i])){
+                    return -1;
+               }
+               n = n*10 + token[i] - '0';
+          }
+          if (n > limits[part]){
+               return -1;
+          }
+          for (i = 0; i<n*tokensPer[part]; i++){
+               if (getToken(lex, &len) == NULL){
+                    return -1;
+               }
+          }
+     }
+     *end = lex->pos;
+     return 1;
+}
+
+void passOneIncremental(LinkContext* ctx, Lexer* lex, PassOne* st){
+     LinkCache* c = ctx->cache;
+     Lexer saved; //Lexer before the module, to parse it after skimming it
+     CacheEntry* e;
+     unsigned long long hash;
+     Module at; //Base and number the next module gets
+     long start, end;
+     int r, hit, m;
+
+     while (refillLexer(lex, 0)); //Piped input, reading all of it so a skimmed module can be parsed again
+     while (1){
+          saved = *lex;
+          r = skimModule(lex, &start, &end);
+          if (r == 0){
+               break; //EoF
+          }
+          hit = -1;
+          if (r == 1){
+               hash = hashBytes(lex->buf + start, end - start);
+               at.baseAddr = st->baseAddr;
+               at.id = st->moduleId;
+               at.outIndex = st->outIndex;
+               hit = findCachedModule(c, hash, end - start, at);
+          }
+          if (hit != -1 && c->prog->modules[hit].length > instrBudget(ctx, st->totalInstr)){
+               hit = -1; //Too many instr here, parsed again for the error
+          }
+          if (hit != -1){ //Same text parsed fine last time, the limits above are all that depends on where it is
+               copyModuleToProgram(ctx->program, c->prog, &c->prog->modules[hit]);
+          } else{
+               *lex = saved;
+               parseModule(lex, ctx->program, instrBudget(ctx, st->totalInstr), LONG_MAX, &start);
+               start -= lex->base;
+               end = lex->pos;
+               hash = hashBytes(lex->buf + start, end - start);
+          }
+
+          m = ctx->program->modCount - 1;
+          if (m == c->hitCap){
+               c->hitOf = growArray(c->hitOf, &c->hitCap, sizeof(int), "passOneIncremental:hitOf");
+          }
+          if (m == c->entryCap){
+               c->newEntries = growArray(c->newEntries, &c->entryCap, sizeof(CacheEntry), "passOneIncremental:newEntries");
+          }
+          c->hitOf[m] = hit;
+          c->changed |= hit != m;
+          e = &c->newEntries[m];
+          memset(e, 0, sizeof(CacheEntry));
+          e->hash = hash;
+          e->textLen = end - start;
+          defineModule(ctx, st, ctx->program, &ctx->program->modules[m]);
+     }
+}
+
+void passTwoIncremental(LinkContext* ctx){
+     LinkCache* c = ctx->cache;
+     RelocWorker w; //Relocates the modules that cannot be reused
+     OutBuf out; //Output of one module
+     ModuleIR* modIR;
+     ModuleIR* cached;
+     UseDep* dep; //What the module's uses resolve to in this link
+     UseDep* old; //What they resolved to when the cached output was made
+     CacheEntry* e;
+     int syms[16]; //Per use, index of the symbol it resolves to, text modules have at most 16 uses
+     int used[16]; //Per use, from relocateModule
+     int m, k, hit, reuse;
+     long long t; //Phase start for --stats
+
+     t = ctx->statsOn ? nowNanos() : 0;
+     printSymbolTable(&ctx->out, ctx->symTable);
+     STAT_TIME(ctx, symtabNanos, t);
+     t = ctx->statsOn ? nowNanos() : 0;
+     c->newDeps = (UseDep*)malloc((ctx->program->useCount + 1) * sizeof(UseDep));
+     __atomic_add_fetch(&heapAllocs, 1, __ATOMIC_RELAXED);
+     if (c->newDeps == NULL){
+          fprintf(stderr, "passTwoIncremental:newDeps Failed to allocate memory.\n");
+          exit(-1);
+     }
+     initRelocWorker(ctx, &w);
+     w.useUsed = used;
+     initOutBuf(&out, -1);
+     for (m=0; m<ctx->program->modCount; m++){
+          modIR = &ctx->program->modules[m];
+          e = &c->newEntries[m];
+          dep = c->newDeps + modIR->useStart;
+          for (k=0; k<modIR->useCount; k++){
+               syms[k] = findSymbolInTable(ctx->symTable, ctx->program->strings + ctx->program->uses[modIR->useStart + k]);
+               dep[k].absAddr = syms[k] != -1 ? ctx->symTable->absAddr[syms[k]] : 0;
+               dep[k].flags = syms[k] != -1 ? USE_DEFINED : 0;
+          }
+
+          //Output only depends on the text, the base, the module number, the first row and what the uses resolve to
+          hit = c->hitOf[m];
+          reuse = hit != -1 && c->entries[hit].baseAddr == modIR->mod.baseAddr && c->entries[hit].moduleId == modIR->mod.id
+               && c->entries[hit].outIndex == modIR->mod.outIndex;
+          if (reuse){
+               cached = &c->prog->modules[hit];
+               old = c->deps + cached->useStart;
+               for (k=0; k<modIR->useCount && reuse; k++){
+                    reuse = dep[k].absAddr == old[k].absAddr && dep[k].flags == (old[k].flags & USE_DEFINED);
+               }
+          }
+          if (reuse){
+               outBytes(&out, c->out + c->entries[hit].outStart, c->entries[hit].outLen);
+               for (k=0; k<modIR->useCount; k++){
+                    dep[k].flags = old[k].flags;
+                    if (dep[k].flags == (USE_DEFINED|USE_USED)){ //Rule 4 marks, as relocating would have set them
+                         BIT_SET(ctx->symTable->used, syms[k]);
+                    }
+               }
+          } else{
+               c->changed = 1;
+               relocateModule(modIR, &w, &out);
+               for (k=0; k<modIR->useCount; k++){
+                    dep[k].flags |= used[k] ? USE_USED : 0;
+               }
+          }
+          e->baseAddr = modIR->mod.baseAddr;
+          e->moduleId = modIR->mod.id;
+          e->outIndex = modIR->mod.outIndex;
+          e->outStart = c->newOut.size;
+          e->outLen = out.size;
+          outBytes(&c->newOut, out.data, out.size);
+          writeOutBuf(&ctx->out, &out);
+     }
+     free(out.data);
+     mergeRelocWorker(&w);
+     STAT_TIME(ctx, relocateNanos, t);
+     t = ctx->statsOn ? nowNanos() : 0;
+     rule4Violation(ctx);
+     STAT_TIME(ctx, rule4Nanos, t);
+}
@@ -0,0 +1,33 @@
+//Symbol index file, what linker --symbol-index writes next to a link and symquery reads.
+//A header followed by sections in this order: symbols (IndexSymbol records sorted by abs addr,
+//then by definition order), modules (IndexModule records sorted by base addr, then by id),
+//hash (open addressing over the symbols by name, hashCap slots of a symbol record index,
+//-1 = empty slot, linear probing from hash & (hashCap-1)), strings (symbol names, null terminated).
+//Native byte order, every section 8 byte aligned like an object file, so it is used mapped.
+
+#define INDEX_MAGIC "LNKSYM1\n" //First 8 bytes of a symbol index
+#define INDEX_SYM_MULTIPLE 1 //IndexSymbol flag, defined more than once (rule 2)
+#define INDEX_SYM_USED 2 //IndexSymbol flag, an E instruction referenced it
+
+typedef struct{
+     char magic[8]; //INDEX_MAGIC
+     int symbolCount; //Records in the symbol section
+     int moduleCount; //Records in the module section
+     int hashCap; //Slots in the hash section, a power of 2 at least twice symbolCount
+     int strSize; //Bytes in the string section
+     long long symbolOff, moduleOff, hashOff, strOff; //Section offsets from the start of the file
+}IndexHeader;
+
+typedef struct{
+     int absAddr; //Abs addr as in the symbol table
+     int module; //Module the symbol was defined in
+     int name; //Offset of the symbol name in the string section
+     unsigned int hash; //32 bit FNV-1a hash of the name, the hash section probes with it
+     int flags; //INDEX_SYM_ flags
+}IndexSymbol;
+
+typedef struct{
+     int id; //Module number as the output prints it
+     int baseAddr; //First abs addr of the module
+     int size; //Instructions of the module, its addrs are baseAddr to baseAddr+size-1
+}IndexModule;
@@ -0,0 +1,226 @@
+#include "stdio.h" //printf, fgets
+#include "stdlib.h" //exit, strtol
+#include "string.h" //strcmp, strlen, memcmp
+#include "fcntl.h" //open
+#include "unistd.h" //close
+#include "sys/mman.h" //mmap
+#include "sys/stat.h" //fstat
+#include "symindex.h" //IndexHeader
+
+//Looks up symbols in an index written by linker --symbol-index, see usage().
+//The index is mapped and used in place: an address is found by binary search over the
+//address sorted symbols and modules, a name through the hash section.
+
+typedef struct{
+     char* map; //Index file mapping
+     long size; //Bytes mapped
+     IndexHeader* h; //Header at the start of map
+     IndexSymbol* syms; //Symbol section, sorted by abs addr
+     IndexModule* mods; //Module section, sorted by base addr
+     int* slots; //Hash section
+     char* strings; //String section
+     int maxSize; //Largest module size, bounds the walk back over modules that start below an addr
+}SymbolIndex;
+
+void usage(const char*); //Prints the options, exit()
+void openIndex(SymbolIndex*, const char*); //Maps and checks an index file, exit() when it is not one
+int sectionFits(long long, long long, long long, long); //Checks count records of a size at an offset lie in a file of total bytes
+int query(SymbolIndex*, const char*); //Answers one query on stdout, 0 when nothing matched
+int lookupName(SymbolIndex*, const char*); //Symbol record of a name, -1 when not defined
+int lookupModule(SymbolIndex*, int); //Module record that holds an addr, -1 when none does
+int lookupAddr(SymbolIndex*, int); //First symbol record at the highest abs addr not past an addr, -1 when none
+unsigned int hashName(const char*); //32 bit FNV-1a, the hash the linker writes
+
+int main(int argc, char* argv[]){
+     SymbolIndex idx;
+     char line[4096];
+     int k, len, missed = 0;
+
+     if (argc < 2){
+          usage(argv[0]);
+     }
+     openIndex(&idx, argv[1]);
+     if (argc > 2){
+          for (k = 2; k<argc; k++){
+               missed |= !query(&idx, argv[k]);
+          }
+     } else{ //One query per line
+          while (fgets(line, sizeof(line), stdin) != NULL){
+               len = strlen(line);
+               while (len > 0 && (line[len-1] == '\n' || line[len-1] == ' ' || line[len-1] == '\t')){
+                    line[--len] = '\0';
+               }
+               if (len > 0){
+                    missed |= !query(&idx, line);
+               }
+          }
+     }
+     return missed;
+}
+
+void usage(const char* name){
+     fprintf(stderr, "Usage: %s indexfile [addr|symbol...]\n", name);
+     fprintf(stderr, "  addr    prints the symbol at or below it in its module, symbol+offset, and the module\n");
+     fprintf(stderr, "  symbol  prints symbol=addr and its module\n");
+     fprintf(stderr, "  Queries are read one per line from stdin without any. Exits 1 when one matched nothing\n");
+     exit(-1);
+}
+
+void openIndex(SymbolIndex* idx, const char* filename){
+     struct stat sb;
+     IndexHeader* h;
+     int fd, i;
+
+     fd = open(filename, O_RDONLY);
+     if (fd < 0 || fstat(fd, &sb) != 0){
+          fprintf(stderr, "Cannot open file: %s.\n", filename);
+          exit(-1);
+     }
+     idx->size = sb.st_size;
+     idx->map = idx->size > 0 ? (char*)mmap(NULL, idx->size, PROT_READ, MAP_PRIVATE, fd, 0) : (char*)MAP_FAILED;
+     close(fd);
+     h = (IndexHeader*)idx->map;
+     if (idx->map == MAP_FAILED || idx->size < (long)sizeof(IndexHeader) || memcmp(h->magic, INDEX_MAGIC, 8) != 0
+          || h->symbolCount < 0 || h->moduleCount < 0 || h->strSize < 0 || h->hashCap < 1 || (h->hashCap & (h->hashCap - 1)) != 0
+          || h->hashCap < 2*(long long)h->symbolCount
+          || !sectionFits(h->symbolOff, h->symbolCount, sizeof(IndexSymbol), idx->size)
+          || !sectionFits(h->moduleOff, h->moduleCount, sizeof(IndexModule), idx->size)
+          || !sectionFits(h->hashOff, h->hashCap, sizeof(int), idx->size)
+          || !sectionFits(h->strOff, h->strSize, 1, idx->size) || (h->strSize > 0 && idx->map[h->strOff + h->strSize - 1] != '\0')){
+          fprintf(stderr, "Not a symbol index: %s.\n", filename);
+          exit(-1);
+     }
+     idx->h = h;
+     idx->syms = (IndexSymbol*)(idx->map + h->symbolOff);
+     idx->mods = (IndexModule*)(idx->map + h->moduleOff);
+     idx->slots = (int*)(idx->map + h->hashOff);
+     idx->strings = idx->map + h->strOff;
+     idx->maxSize = 0;
+     for (i = 0; i<h->moduleCount; i++){
+          if (idx->mods[i].size > idx->maxSize){
+               idx->maxSize = idx->mods[i].size;
+          }
+     }
+     for (i = 0; i<h->symbolCount; i++){ //Names are read without further checks
+          if (idx->syms[i].name < 0 || idx->syms[i].name >= h->strSize){
+               fprintf(stderr, "Not a symbol index: %s.\n", filename);
+               exit(-1);
+          }
+     }
+}
+
+//Checked against the room left after off, off + count*size could overflow for a damaged offset
+int sectionFits(long long off, long long count, long long size, long total){
+     return off >= 0 && off <= total && count >= 0 && count <= (total - off) / size;
+}
+
+//An addr starts with a digit or a minus, negative module lengths can move modules below 0
+int query(SymbolIndex* idx, const char* q){
+     IndexSymbol* s;
+     IndexModule* m;
+     char* end;
+     long addr;
+     int k, j;
+
+     if ((q[0] >= '0' && q[0] <= '9') || q[0] == '-'){
+          addr = strtol(q, &end, 10);
+          if (*end != '\0' || addr < -2147483647L - 1 || addr > 2147483647L){
+               printf("%s: not an address\n", q);
+               return 0;
+          }
+          k = lookupModule(idx, (int)addr);
+          if (k == -1){
+               printf("%ld: no module\n", addr);
+               return 0;
+          }
+          m = &idx->mods[k];
+          j = lookupAddr(idx, (int)addr);
+          if (j != -1 && idx->syms[j].module == m->id){
+               s = &idx->syms[j];
+               printf("%ld: %s+%ld module=%d base=%d size=%d\n", addr, idx->strings + s->name, addr - s->absAddr, m->id, m->baseAddr, m->size);
+          } else{ //Nothing defined in the module before addr
+               printf("%ld: module=%d base=%d size=%d\n", addr, m->id, m->baseAddr, m->size);
+          }
+          return 1;
+     }
+     j = lookupName(idx, q);
+     if (j == -1){
+          printf("%s: not defined\n", q);
+          return 0;
+     }
+     s = &idx->syms[j];
+     printf("%s=%d module=%d%s%s\n", q, s->absAddr, s->module, s->flags & INDEX_SYM_MULTIPLE ? " multiple" : "", s->flags & INDEX_SYM_USED ? "" : " unused");
+     return 1;
+}
+
+int lookupName(SymbolIndex* idx, const char* name){
+     unsigned int hash = hashName(name);
+     int slot, i;
+
+     for (slot = hash & (idx->h->hashCap - 1); (i = idx->slots[slot]) != -1; slot = (slot + 1) & (idx->h->hashCap - 1)){
+          if (i < 0 || i >= idx->h->symbolCount){ //Damaged slot
+               return -1;
+          }
+          if (idx->syms[i].hash == hash && strcmp(idx->strings + idx->syms[i].name, name) == 0){
+               return i;
+          }
+     }
+     return -1;
+}
+
+//Modules overlap only after negative lengths, then the one with the highest base wins
+int lookupModule(SymbolIndex* idx, int addr){
+     int lo = 0, hi = idx->h->moduleCount, mid, k;
+
+     while (lo < hi){ //First module with a base past addr
+          mid = lo + (hi - lo) / 2;
+          if (idx->mods[mid].baseAddr <= addr){
+               lo = mid + 1;
+          } else{
+               hi = mid;
+          }
+     }
+     for (k = lo - 1; k >= 0 && (long long)idx->mods[k].baseAddr + idx->maxSize > addr; k--){
+          if ((long long)idx->mods[k].baseAddr + idx->mods[k].size > addr){
+               return k;
+          }
+     }
+     return -1;
+}
+
+int lookupAddr(SymbolIndex* idx, int addr){
+     int lo = 0, hi = idx->h->symbolCount, mid, at;
+
+     while (lo < hi){ //First symbol past addr
+          mid = lo + (hi - lo) / 2;
+          if (idx->syms[mid].absAddr <= addr){
+               lo = mid + 1;
+          } else{
+               hi = mid;
+          }
+     }
+     if (lo == 0){
+          return -1;
+     }
+     at = idx->syms[lo - 1].absAddr;
+     hi = lo - 1;
+     lo = 0;
+     while (lo < hi){ //First symbol at that addr, the one defined first
+          mid = lo + (hi - lo) / 2;
+          if (idx->syms[mid].absAddr < at){
+               lo = mid + 1;
+          } else{
+               hi = mid;
+          }
+     }
+     return lo;
+}
+
+unsigned int hashName(const char* str){
+     unsigned int h = 2166136261u; //FNV offset basis
+     while (*str != '\0'){
+          h ^= (unsigned char)*str++;
+          h *= 16777619u; //FNV prime
+     }
+     return h;
+}
@@ -0,0 +1,112 @@
+#!/bin/sh
+# Regression inputs, make check runs it.
+# Every tests/NAME.txt is linked serially, with -j 3, piped through --pipeline, twice with
+# --cache, and as an object made by -c, and each output has to be tests/NAME.out byte for byte.
+# Features that need more than one input link from tests/inputs, into tests/NAME.out of the
+# feature. Damaged binary files are made by patching the header of a good one, and have to fail
+# cleanly with their error message, or for a cache be ignored.
+# Usage: tests/run.sh
+
+tmp=${TMPDIR:-/tmp}/linker-check-$$
+fails=0
+trap 'rm -rf $tmp.out $tmp.err $tmp.cache $tmp.o $tmp.a $tmp.idx $tmp.list $tmp.img $tmp.dir' EXIT
+
+compare(){ # name, what was linked
+     if ! cmp -s tests/$1.out $tmp.out; then
+          echo "$1 $2: output differs from tests/$1.out"
+          fails=$((fails + 1))
+     fi
+}
+
+reject(){ # what, first line of stderr, command that has to exit -1 with it
+     what=$1
+     expect=$2
+     shift 2
+     "$@" > $tmp.out 2> $tmp.err
+     status=$?
+     if [ $status -ne 255 ] || [ "$(head -n 1 $tmp.err)" != "$expect" ]; then
+          echo "$what: exit $status, $(head -n 1 $tmp.err)"
+          fails=$((fails + 1))
+     fi
+}
+
+poke(){ # file, offset, bytes as printf octal escapes, native byte order
+     printf "$3" | dd of=$1 bs=1 seek=$2 conv=notrunc 2> /dev/null
+}
+
+for input in tests/*.txt; do
+     name=$(basename $input .txt)
+     ./linker $input > $tmp.out
+     compare $name serial
+     ./linker -j 3 $input > $tmp.out
+     compare $name "-j 3"
+     cat $input | ./linker --pipeline > $tmp.out
+     compare $name --pipeline
+     rm -f $tmp.cache
+     ./linker --cache $tmp.cache $input > $tmp.out
+     compare $name "--cache, first link"
+     ./linker --cache $tmp.cache $input > $tmp.out
+     compare $name "--cache, relink"
+     ./linker -c $tmp.o $input
+     ./linker $tmp.o > $tmp.out
+     compare $name "-c, linked as an object"
+done
+
+files="tests/errors.txt tests/negative-length.txt tests/inputs/archive-lib.txt"
+./linker $files > $tmp.out
+compare multi-file "several inputs"
+./linker -j 3 $files > $tmp.out
+compare multi-file "several inputs, -j 3"
+
+./linker --make-archive $tmp.a tests/inputs/archive-lib.txt
+./linker --archive $tmp.a tests/inputs/archive-main.txt > $tmp.out
+compare archive --archive
+
+./linker --symbol-index $tmp.idx tests/inputs/archive-lib.txt > /dev/null
+./symquery $tmp.idx f g unused nosuch 0 3 6 -1 > $tmp.out
+compare symbol-index symquery
+
+./linker --operand-width 5 --machine-size 20000 tests/inputs/large.txt > $tmp.out
+compare large --large
+./linker -j 3 --operand-width 5 --machine-size 20000 tests/inputs/large.txt > $tmp.out
+compare large "--large -j 3"
+
+./linker --image $tmp.img tests/inputs/archive-lib.txt
+od -A d -t d4 $tmp.img > $tmp.out #Images are compared as native ints
+compare image --image
+./linker --image $tmp.img tests/inputs/image-below-zero.txt
+od -A d -t d4 $tmp.img > $tmp.out
+compare image-below-zero --image
+
+./linker --batch tests/inputs/batch.list -j 2 > $tmp.out 2> /dev/null
+compare batch "--batch -j 2"
+mkdir -p $tmp.dir
+echo tests/negative-length.txt | ./linker --batch - --batch-out $tmp.dir
+cp $tmp.dir/negative-length.txt.out $tmp.out
+compare negative-length --batch-out
+printf 'tests/negative-length.txt\ntests/inputs/../negative-length.txt\n' > $tmp.list
+reject "--batch-out, two inputs of one file name" "--batch-out names each output after its input's file name, two inputs would write $tmp.dir/negative-length.txt.out." ./linker --batch $tmp.list --batch-out $tmp.dir
+
+reject "-j with trailing junk" "Invalid job count: 4x." ./linker -j 4x tests/negative-length.txt
+reject "--operand-width with trailing junk" "Invalid operand width: 3zz." ./linker --operand-width 3zz tests/negative-length.txt
+
+#ObjHeader: counts from offset 8, moduleOff 32, defOff 40
+./linker -c $tmp.o tests/negative-length.txt
+poke $tmp.o 12 '\001\000\000\000'
+poke $tmp.o 40 '\370\377\377\377\377\377\377\177'
+reject "object, def section past the end" "Invalid object file: $tmp.o." ./linker $tmp.o
+#ArchiveHeader: after the ObjHeader, symbolOff 88
+poke $tmp.a 88 '\370\377\377\377\377\377\377\177'
+reject "archive, symbol section past the end" "Invalid archive file: $tmp.a." ./linker --archive $tmp.a tests/inputs/archive-main.txt
+#CacheHeader: after the ObjHeader, entryOff 96
+rm -f $tmp.cache
+./linker --cache $tmp.cache tests/negative-length.txt > /dev/null
+poke $tmp.cache 96 '\370\377\377\377\377\377\377\177'
+./linker --cache $tmp.cache tests/negative-length.txt > $tmp.out
+compare negative-length "--cache, entry section past the end"
+#IndexHeader: counts from offset 8, strOff 48
+poke $tmp.idx 48 '\370\377\377\377\377\377\377\177'
+reject "index, string section past the end" "Not a symbol index: $tmp.idx." ./symquery $tmp.idx f
+
+echo "fails=$fails"
+[ $fails -eq 0 ]
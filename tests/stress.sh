@@ -0,0 +1,33 @@
+#!/bin/sh
+# Stress test of the threaded pass 1, make stress runs it, and make check runs 3 rounds.
+# Links generated inputs full of duplicate and out of range defs with bench/linker-stress, a linker
+# built to parse and define on threads whatever the input size, and checks that every -j gives
+# the output of a serial link, symbol table and rule 2 and 5 messages included. The same linker
+# has tiny --pipeline rings, so piping the input through it wraps and refills them all the time.
+# Usage: tests/stress.sh [rounds]
+
+rounds=${1:-20}
+tmp=${TMPDIR:-/tmp}/linker-stress-$$
+fails=0
+trap 'rm -f $tmp.in $tmp.out $tmp.exp' EXIT
+
+seed=1
+while [ $seed -le $rounds ]; do
+     ./bench/gen -m $((seed * 500)) -d 16 -u 4 -f 0.3 -s $seed -o $tmp.in > /dev/null || exit 1
+     ./linker $tmp.in > $tmp.exp
+     for jobs in 2 3 8; do
+          ./bench/linker-stress -j $jobs $tmp.in > $tmp.out
+          if ! cmp -s $tmp.exp $tmp.out; then
+               echo "seed $seed -j $jobs: output differs from the serial link"
+               fails=$((fails + 1))
+          fi
+     done
+     cat $tmp.in | ./bench/linker-stress --pipeline > $tmp.out
+     if ! cmp -s $tmp.exp $tmp.out; then
+          echo "seed $seed --pipeline: output differs from the serial link"
+          fails=$((fails + 1))
+     fi
+     seed=$((seed + 1))
+done
+echo "rounds=$rounds fails=$fails"
+[ $fails -eq 0 ]